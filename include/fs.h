@@ -0,0 +1,90 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Filesystem backend. Every call follows the POSIX convention: failures
+// return -1 (or NULL) and set errno.
+typedef struct fs_backend {
+  const char *name;
+  void       *ctx;
+
+  void*          (*opendir) (void *ctx, const char *path);
+  struct dirent* (*readdir) (void *ctx, void *dp);
+  int            (*closedir)(void *ctx, void *dp);
+  int            (*stat)    (void *ctx, const char *path, struct stat *st);
+  int            (*mkdir)   (void *ctx, const char *path);
+  int            (*remove)  (void *ctx, const char *path);
+  int            (*rename)  (void *ctx, const char *from, const char *to);
+  int            (*chdir)   (void *ctx, const char *path);
+  char*          (*getcwd)  (void *ctx, char *buf, size_t size);
+  void*          (*open)    (void *ctx, const char *path, const char *mode);
+  ssize_t        (*read)    (void *ctx, void *fp, void *buf, size_t len);
+  ssize_t        (*write)   (void *ctx, void *fp, const void *buf, size_t len);
+  int            (*close)   (void *ctx, void *fp);
+  int            (*space)   (void *ctx, const char *path, uint64_t *avail);
+  void           (*destroy) (struct fs_backend *fs);
+} fs_backend_t;
+
+// select the backend used by the fs_* calls below (NULL restores POSIX)
+void          fs_set_backend(fs_backend_t *fs);
+fs_backend_t* fs_get_backend(void);
+
+void*          fs_opendir (const char *path);
+struct dirent* fs_readdir (void *dp);
+int            fs_closedir(void *dp);
+int            fs_stat    (const char *path, struct stat *st);
+int            fs_mkdir   (const char *path);
+int            fs_remove  (const char *path);
+int            fs_rename  (const char *from, const char *to);
+int            fs_chdir   (const char *path);
+char*          fs_getcwd  (char *buf, size_t size);
+void*          fs_open    (const char *path, const char *mode);
+ssize_t        fs_read    (void *fp, void *buf, size_t len);
+ssize_t        fs_write   (void *fp, const void *buf, size_t len);
+int            fs_close   (void *fp);
+int            fs_space   (const char *path, uint64_t *avail);
+
+// the real filesystem (FAT on the console)
+fs_backend_t* fs_posix_backend(void);
+
+// in-memory tree rooted at "/"
+fs_backend_t* fs_mem_create(void);
+void          fs_mem_set_capacity(fs_backend_t *fs, uint64_t bytes);
+
+// SD card simulator wrapped around another backend
+typedef struct {
+  uint32_t cmdLatency;   // us per metadata call (open, stat, readdir, ...)
+  uint32_t readLatency;  // us per read call
+  uint32_t writeLatency; // us per write call
+  uint32_t readRate;     // bytes per second, 0 is unlimited
+  uint32_t writeRate;    // bytes per second, 0 is unlimited
+  void     (*delay)(uint32_t us); // optional real wait, NULL only advances the clock
+} fs_sdsim_params_t;
+
+typedef struct {
+  uint64_t clock;        // simulated time in us
+  uint32_t calls;
+  uint64_t bytesRead;
+  uint64_t bytesWritten;
+} fs_sdsim_stats_t;
+
+// typical class 2 and class 10 cards
+extern const fs_sdsim_params_t fs_sdsim_slow_card;
+extern const fs_sdsim_params_t fs_sdsim_fast_card;
+
+fs_backend_t* fs_sdsim_create(fs_backend_t *inner, const fs_sdsim_params_t *params);
+void          fs_sdsim_stats(fs_backend_t *fs, fs_sdsim_stats_t *stats);
+void          fs_sdsim_reset(fs_backend_t *fs);
+
+void fs_destroy(fs_backend_t *fs);
+
+#ifdef __cplusplus
+}
+#endif
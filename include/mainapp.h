@@ -1,6 +1,10 @@
 #pragma once
 #include <feos.h>
 #include <coopgui.h>
+#include <time.h>
+#include "transfer.h"
+#include "membudget.h"
+#include "thumbs.h"
 using namespace FeOS::UI;
 
 #define NUM_ENTRIES 11
@@ -47,17 +51,34 @@ private:
   command_t     command;
   state_t       state;
   FileIconPtr   *pIcons;
+  u8            *iconLoaded;
+  int           numIcons;
+  int           iconClient;
+  thumbcache_t  *thumbs;
+  bool          thumbMode;
+  bool          debug;
+  int           debugTimer;
+  transfer_t    *transfer;
+  time_t        transferStart;
 
   void redrawCwd();
   void redrawInfo();
   void redrawList();
+  void redrawDebug();
   void processMainScreen(touchPosition &touch, int down, int repeat);
   void processSubScreen(touchPosition &touch, int down, int repeat);
   void Copy(touchPosition &touch, int down, int repeat);
   void Move(touchPosition &touch, int down, int repeat);
   void Delete(touchPosition &touch, int down, int repeat);
   void Rename(touchPosition &touch, int down, int repeat);
+  void Transfer(int down, bool move);
   void loadIcons();
+  void freeIcons();
+  FileIconPtr getIcon(int i);
+  void rescan();
+  void openThumbs();
+  void closeThumbs();
+  void updateThumbs();
 
 public:
   MainApp();
@@ -65,4 +86,5 @@ public:
   void OnActivate();
   void OnDeactivate();
   void OnVBlank();
+  size_t evictIcons(size_t want);
 };
@@ -0,0 +1,52 @@
+#pragma once
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef MB_DEFAULT_LIMIT
+#define MB_DEFAULT_LIMIT (1024*1024)
+#endif
+
+#define MB_MAX_CLIENTS 8
+
+// free up to want bytes of cached data and return how much was freed
+typedef size_t (*mb_evict_t)(void *ctx, size_t want);
+
+typedef struct {
+  const char *name;
+  size_t     used;
+  size_t     peak;
+  unsigned   evictions; // times this client was asked to shrink
+} mb_stats_t;
+
+// caches register once; evict may be NULL for memory that can't be dropped,
+// such as the directory listing. that memory may go over the limit, which
+// then only makes the caches shrink
+int    mb_register(const char *name, mb_evict_t evict, void *ctx);
+void   mb_unregister(int id);
+
+void   mb_set_limit(size_t bytes);
+size_t mb_limit(void);
+size_t mb_used(void);
+
+// allocations charged to a client. when the budget or the heap runs out,
+// caches are shrunk, least recently used first, before giving up
+void*  mb_malloc(int id, size_t size);
+void*  mb_realloc(int id, void *ptr, size_t size);
+void   mb_free(int id, void *ptr);
+char*  mb_strdup(int id, const char *str);
+
+// charge memory allocated elsewhere, e.g. by the GUI library
+int    mb_reserve(int id, size_t size);
+void   mb_release(int id, size_t size);
+
+// mark a client as recently used
+void   mb_touch(int id);
+
+int    mb_stats(int id, mb_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
@@ -10,7 +10,9 @@ int scandir(const char *dir,
             struct dirent ***dirList,
             int(*filter)(const struct dirent *),
             int(*compar)(const struct dirent **, const struct dirent **));
+int parentscandir(struct dirent ***dirList);
 void freescandir(struct dirent **dirList, int numEntries);
+void freescandirent(struct dirent *dent);
 
 int generic_scandir_filter(const struct dirent* dent);
 int generic_scandir_compar(const struct dirent **dent1, const struct dirent **dent2);
@@ -0,0 +1,74 @@
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include <dirent.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// thumbnails match the 16x16 bitmap sprites used for file icons
+#define THUMB_SIZE   16
+#define THUMB_PIXELS (THUMB_SIZE*THUMB_SIZE)
+#define THUMB_FILE   ".exb0rker.thumbs"
+
+typedef enum {
+  THUMB_NONE = 0, // not an image
+  THUMB_PENDING,  // not checked yet, may hold pixels from the cache file
+  THUMB_EVICTED,  // dropped for memory, read back once it is visible again
+  THUMB_READY,
+  THUMB_FAILED,   // could not be decoded
+} thumb_state_t;
+
+typedef struct {
+  char          *name;
+  uint32_t      size;   // key of the pixels, from stat
+  uint32_t      mtime;
+  int           keyed;  // size and mtime are known
+  int           failed; // the keyed file can't be decoded
+  uint32_t      stored; // offset of the pixels in the cache file, 0 if none
+  thumb_state_t state;
+  uint16_t      *pixels;
+} thumb_t;
+
+typedef struct thumbjob thumbjob_t;
+
+typedef struct {
+  char       path[FILENAME_MAX]; // cache file of the folder
+  int        client;
+  thumb_t    *thumbs;            // parallel to the directory listing
+  int        count;
+  int        pending;
+  int        cursor;             // background position
+  int        first, last;        // visible rows
+  thumbjob_t *job;               // decode in progress, its thumbnail is never evicted
+  thumbjob_t *reader;            // cache file left open after reading a thumbnail back
+  int        dirty;
+} thumbcache_t;
+
+int thumb_is_image(const char *name);
+
+// decode an image and box filter it down to THUMB_SIZE, keeping its aspect
+// ratio. pixels are in the 16-bit sprite format, transparent around the edges
+int thumb_decode(const char *path, uint16_t *pixels);
+
+// start thumbnailing a listing of the cwd, with whatever the cache file has
+thumbcache_t*   thumbs_open(struct dirent **list, int count);
+
+// check or decode thumbnails for about *budget bytes of image data, rows
+// first to last-1 before the others. a decode carries on over several calls.
+// returns the index of a thumbnail that changed, or -1 once the budget is
+// spent or there is nothing left to do
+int             thumbs_step(thumbcache_t *tc, int first, int last, size_t *budget);
+
+const uint16_t* thumbs_get(thumbcache_t *tc, int i);
+void            thumbs_remove(thumbcache_t *tc, int i);
+
+// write the cache file back if anything new was decoded, keeping what it
+// already holds for thumbnails which were dropped for memory
+int             thumbs_save(thumbcache_t *tc);
+void            thumbs_close(thumbcache_t *tc);
+
+#ifdef __cplusplus
+}
+#endif
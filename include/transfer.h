@@ -0,0 +1,74 @@
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// bytes an item is worth on top of its size, for progress and ETA
+#define TRANSFER_ITEM_COST 4096
+
+typedef enum {
+  TRANSFER_PLAN = 0, // walking the source tree
+  TRANSFER_COPY,     // copying the plan, journaling completed items
+  TRANSFER_REMOVE,   // removing the source after a move
+  TRANSFER_DONE,
+  TRANSFER_ERROR,
+} transfer_phase_t;
+
+typedef struct {
+  char     *path;  // relative to the source, "" for the source itself
+  uint64_t size;
+  int      isDir;
+} transfer_item_t;
+
+typedef struct {
+  char             src[FILENAME_MAX];
+  char             dst[FILENAME_MAX];
+  char             journal[FILENAME_MAX];
+  int              move;
+  transfer_phase_t phase;
+  int              error;      // errno when phase is TRANSFER_ERROR
+
+  transfer_item_t  *items;     // the plan, parents before their children
+  int              numItems;
+  int              capItems;
+  int              scanned;    // items already expanded during planning
+  struct dirent    **list;     // directory being expanded
+  int              listLen;
+  int              listPos;
+
+  int              current;    // next item to copy or remove
+  int              resumed;    // items skipped thanks to the journal
+  int              copied;     // a move has copied everything, the journal says so
+  uint64_t         totalBytes;
+  uint64_t         doneBytes;
+  uint64_t         sessionWork; // work done since start, for the ETA
+
+  void             *in, *out;  // file being copied
+  char             *buf;
+  char             *pending;   // journal lines not yet written
+  size_t           pendingLen;
+} transfer_t;
+
+// start copying (or moving) src to dst; a journal left by an interrupted
+// transfer of the same src and dst is picked up automatically
+transfer_t*      transfer_start(const char *src, const char *dst, int move);
+
+// do about budget bytes of work
+transfer_phase_t transfer_step(transfer_t *t, size_t budget);
+
+// stop and release everything, keeping the journal so it can be resumed
+void             transfer_free(transfer_t *t);
+
+// work left in bytes, counting TRANSFER_ITEM_COST per item; and the
+// seconds left given the seconds spent so far (0 while still planning)
+uint64_t         transfer_remaining(const transfer_t *t);
+uint32_t         transfer_eta(const transfer_t *t, uint32_t elapsed);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include "fs.h"
+
+static fs_backend_t *current = NULL;
+
+void fs_set_backend(fs_backend_t *fs) {
+  current = fs;
+}
+
+fs_backend_t* fs_get_backend(void) {
+  if(current == NULL)
+    current = fs_posix_backend();
+  return current;
+}
+
+void fs_destroy(fs_backend_t *fs) {
+  if(fs == current)
+    current = NULL;
+  if(fs->destroy != NULL)
+    fs->destroy(fs);
+}
+
+#define FS fs_get_backend()
+
+void*          fs_opendir (const char *path)                       { return FS->opendir (FS->ctx, path);        }
+struct dirent* fs_readdir (void *dp)                               { return FS->readdir (FS->ctx, dp);          }
+int            fs_closedir(void *dp)                               { return FS->closedir(FS->ctx, dp);          }
+int            fs_stat    (const char *path, struct stat *st)      { return FS->stat    (FS->ctx, path, st);    }
+int            fs_mkdir   (const char *path)                       { return FS->mkdir   (FS->ctx, path);        }
+int            fs_remove  (const char *path)                       { return FS->remove  (FS->ctx, path);        }
+int            fs_rename  (const char *from, const char *to)       { return FS->rename  (FS->ctx, from, to);    }
+int            fs_chdir   (const char *path)                       { return FS->chdir   (FS->ctx, path);        }
+char*          fs_getcwd  (char *buf, size_t size)                 { return FS->getcwd  (FS->ctx, buf, size);   }
+void*          fs_open    (const char *path, const char *mode)     { return FS->open    (FS->ctx, path, mode);  }
+ssize_t        fs_read    (void *fp, void *buf, size_t len)        { return FS->read    (FS->ctx, fp, buf, len); }
+ssize_t        fs_write   (void *fp, const void *buf, size_t len)  { return FS->write   (FS->ctx, fp, buf, len); }
+int            fs_close   (void *fp)                               { return FS->close   (FS->ctx, fp);          }
+int            fs_space   (const char *path, uint64_t *avail)      { return FS->space   (FS->ctx, path, avail); }
+
+// POSIX backend
+static void* posix_opendir(void *ctx, const char *path) {
+  return opendir(path);
+}
+
+static struct dirent* posix_readdir(void *ctx, void *dp) {
+  return readdir((DIR*)dp);
+}
+
+static int posix_closedir(void *ctx, void *dp) {
+  return closedir((DIR*)dp);
+}
+
+static int posix_stat(void *ctx, const char *path, struct stat *st) {
+  return stat(path, st);
+}
+
+static int posix_mkdir(void *ctx, const char *path) {
+  return mkdir(path, 0777);
+}
+
+static int posix_remove(void *ctx, const char *path) {
+  return remove(path);
+}
+
+static int posix_rename(void *ctx, const char *from, const char *to) {
+  return rename(from, to);
+}
+
+static int posix_chdir(void *ctx, const char *path) {
+  return chdir(path);
+}
+
+static char* posix_getcwd(void *ctx, char *buf, size_t size) {
+  return getcwd(buf, size);
+}
+
+static void* posix_open(void *ctx, const char *path, const char *mode) {
+  return fopen(path, mode);
+}
+
+static ssize_t posix_read(void *ctx, void *fp, void *buf, size_t len) {
+  size_t rc = fread(buf, 1, len, (FILE*)fp);
+  if(rc == 0 && ferror((FILE*)fp))
+    return -1;
+  return rc;
+}
+
+static ssize_t posix_write(void *ctx, void *fp, const void *buf, size_t len) {
+  size_t rc = fwrite(buf, 1, len, (FILE*)fp);
+  if(rc != len)
+    return -1;
+  return rc;
+}
+
+static int posix_close(void *ctx, void *fp) {
+  return fclose((FILE*)fp);
+}
+
+static int posix_space(void *ctx, const char *path, uint64_t *avail) {
+  struct statvfs st;
+  if(statvfs(path, &st) != 0)
+    return -1;
+  *avail = (uint64_t)st.f_bavail * st.f_bsize;
+  return 0;
+}
+
+static fs_backend_t posix = {
+  .name     = "posix",
+  .ctx      = NULL,
+  .opendir  = posix_opendir,
+  .readdir  = posix_readdir,
+  .closedir = posix_closedir,
+  .stat     = posix_stat,
+  .mkdir    = posix_mkdir,
+  .remove   = posix_remove,
+  .rename   = posix_rename,
+  .chdir    = posix_chdir,
+  .getcwd   = posix_getcwd,
+  .open     = posix_open,
+  .read     = posix_read,
+  .write    = posix_write,
+  .close    = posix_close,
+  .space    = posix_space,
+  .destroy  = NULL,
+};
+
+fs_backend_t* fs_posix_backend(void) {
+  return &posix;
+}
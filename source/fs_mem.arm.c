@@ -0,0 +1,544 @@
+#include <stdio.h>
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "fs.h"
+
+typedef struct mem_node {
+  char            *name;
+  int             isDir;
+  int             refs;   // open handles
+  struct mem_node *parent;
+  struct mem_node *child; // first child of a directory
+  struct mem_node *next;  // next sibling
+  unsigned char   *data;
+  size_t          size;
+  size_t          cap;
+  time_t          mtime;
+} mem_node_t;
+
+typedef struct {
+  mem_node_t *root;
+  mem_node_t *cwd;
+  time_t     clock;    // bumped on every modification so mtimes are deterministic
+  uint64_t   used;     // bytes of file data
+  uint64_t   capacity; // writes past this fail with ENOSPC
+} mem_fs_t;
+
+typedef struct {
+  mem_node_t    *dir;
+  mem_node_t    *next;
+  int           dots; // "." and ".." left to report
+  struct dirent dent;
+} mem_dir_t;
+
+typedef struct {
+  mem_node_t *node;
+  size_t     pos;
+  int        readable;
+  int        writable;
+  int        append;
+} mem_file_t;
+
+// append so readdir returns entries in creation order, like FAT
+static void node_link(mem_node_t *dir, mem_node_t *node) {
+  mem_node_t **link = &dir->child;
+  while(*link != NULL)
+    link = &(*link)->next;
+  *link = node;
+  node->parent = dir;
+  node->next   = NULL;
+}
+
+static mem_node_t* node_new(mem_fs_t *m, mem_node_t *parent, const char *name, int isDir) {
+  mem_node_t *node = calloc(1, sizeof(mem_node_t));
+  if(node == NULL) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  node->name = strdup(name);
+  if(node->name == NULL) {
+    free(node);
+    errno = ENOMEM;
+    return NULL;
+  }
+  node->isDir = isDir;
+  node->mtime = ++m->clock;
+
+  if(parent != NULL) {
+    node_link(parent, node);
+    parent->mtime = m->clock;
+  }
+  return node;
+}
+
+static void node_free(mem_fs_t *m, mem_node_t *node) {
+  while(node->child != NULL) {
+    mem_node_t *child = node->child;
+    node->child = child->next;
+    node_free(m, child);
+  }
+  m->used -= node->size;
+  free(node->data);
+  free(node->name);
+  free(node);
+}
+
+static void node_unlink(mem_node_t *node) {
+  mem_node_t **link = &node->parent->child;
+  while(*link != node)
+    link = &(*link)->next;
+  *link = node->next;
+  node->next   = NULL;
+  node->parent = NULL;
+}
+
+static mem_node_t* node_child(mem_node_t *dir, const char *name, size_t len) {
+  mem_node_t *node;
+  for(node = dir->child; node != NULL; node = node->next) {
+    if(strncmp(node->name, name, len) == 0 && node->name[len] == 0)
+      return node;
+  }
+  return NULL;
+}
+
+// walk a path. if leaf is not NULL, the last component is not resolved but
+// returned in leaf, and the directory which would contain it is returned
+static mem_node_t* mem_lookup(mem_fs_t *m, const char *path, char *leaf) {
+  mem_node_t *node = m->cwd;
+  const char *p, *end;
+  size_t     len;
+
+  // skip a device prefix such as "fat:"
+  p = strchr(path, ':');
+  if(p != NULL && (strchr(path, '/') == NULL || p < strchr(path, '/')))
+    path = p + 1;
+
+  if(*path == '/')
+    node = m->root;
+
+  for(p = path; *p != 0; p = end) {
+    while(*p == '/')
+      p++;
+    if(*p == 0)
+      break;
+    end = strchr(p, '/');
+    if(end == NULL)
+      end = p + strlen(p);
+    len = end - p;
+
+    if(leaf != NULL && end[strspn(end, "/")] == 0) {
+      if(len > NAME_MAX || (len == 1 && p[0] == '.') || (len == 2 && p[0] == '.' && p[1] == '.')) {
+        errno = EINVAL;
+        return NULL;
+      }
+      memcpy(leaf, p, len);
+      leaf[len] = 0;
+      return node;
+    }
+
+    if(!node->isDir) {
+      errno = ENOTDIR;
+      return NULL;
+    }
+    if(len == 1 && p[0] == '.')
+      continue;
+    if(len == 2 && p[0] == '.' && p[1] == '.') {
+      if(node->parent != NULL)
+        node = node->parent;
+      continue;
+    }
+    node = node_child(node, p, len);
+    if(node == NULL) {
+      errno = ENOENT;
+      return NULL;
+    }
+  }
+
+  if(leaf != NULL) { // path had no last component, e.g. "/"
+    errno = EINVAL;
+    return NULL;
+  }
+  return node;
+}
+
+static int node_is_ancestor(mem_node_t *ancestor, mem_node_t *node) {
+  for(; node != NULL; node = node->parent) {
+    if(node == ancestor)
+      return 1;
+  }
+  return 0;
+}
+
+static void* mem_opendir(void *ctx, const char *path) {
+  mem_fs_t   *m = ctx;
+  mem_node_t *node = mem_lookup(m, path, NULL);
+  mem_dir_t  *dp;
+
+  if(node == NULL)
+    return NULL;
+  if(!node->isDir) {
+    errno = ENOTDIR;
+    return NULL;
+  }
+
+  dp = calloc(1, sizeof(mem_dir_t));
+  if(dp == NULL) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  dp->dir  = node;
+  dp->next = node->child;
+  dp->dots = node == m->root ? 0 : 2;
+  node->refs++;
+  return dp;
+}
+
+static struct dirent* mem_readdir(void *ctx, void *p) {
+  mem_dir_t *dp = p;
+
+  if(dp->dots > 0) {
+    strcpy(dp->dent.d_name, dp->dots == 2 ? "." : "..");
+    dp->dent.d_type = DT_DIR;
+    dp->dots--;
+    return &dp->dent;
+  }
+
+  if(dp->next == NULL)
+    return NULL;
+
+  strncpy(dp->dent.d_name, dp->next->name, sizeof(dp->dent.d_name));
+  dp->dent.d_name[sizeof(dp->dent.d_name)-1] = 0;
+  dp->dent.d_type = dp->next->isDir ? DT_DIR : DT_REG;
+  dp->next = dp->next->next;
+  return &dp->dent;
+}
+
+static int mem_closedir(void *ctx, void *p) {
+  mem_dir_t *dp = p;
+  dp->dir->refs--;
+  free(dp);
+  return 0;
+}
+
+static int mem_stat(void *ctx, const char *path, struct stat *st) {
+  mem_node_t *node = mem_lookup(ctx, path, NULL);
+  if(node == NULL)
+    return -1;
+
+  memset(st, 0, sizeof(*st));
+  st->st_mode  = node->isDir ? S_IFDIR | 0777 : S_IFREG | 0666;
+  st->st_nlink = 1;
+  st->st_size  = node->size;
+  st->st_mtime = node->mtime;
+  st->st_atime = node->mtime;
+  st->st_ctime = node->mtime;
+  return 0;
+}
+
+static int mem_mkdir(void *ctx, const char *path) {
+  char       name[NAME_MAX+1];
+  mem_node_t *dir = mem_lookup(ctx, path, name);
+
+  if(dir == NULL)
+    return -1;
+  if(!dir->isDir) {
+    errno = ENOTDIR;
+    return -1;
+  }
+  if(node_child(dir, name, strlen(name)) != NULL) {
+    errno = EEXIST;
+    return -1;
+  }
+  return node_new(ctx, dir, name, 1) == NULL ? -1 : 0;
+}
+
+static int mem_remove(void *ctx, const char *path) {
+  mem_fs_t   *m = ctx;
+  mem_node_t *node = mem_lookup(m, path, NULL);
+
+  if(node == NULL)
+    return -1;
+  if(node == m->root || node_is_ancestor(node, m->cwd) || node->refs > 0) {
+    errno = EBUSY;
+    return -1;
+  }
+  if(node->child != NULL) {
+    errno = ENOTEMPTY;
+    return -1;
+  }
+
+  node->parent->mtime = ++m->clock;
+  node_unlink(node);
+  node_free(m, node);
+  return 0;
+}
+
+static int mem_rename(void *ctx, const char *from, const char *to) {
+  mem_fs_t   *m = ctx;
+  char       name[NAME_MAX+1];
+  mem_node_t *node = mem_lookup(m, from, NULL);
+  mem_node_t *dir, *old;
+  char       *newName;
+
+  if(node == NULL)
+    return -1;
+  if(node == m->root || node->refs > 0) {
+    errno = EBUSY;
+    return -1;
+  }
+
+  dir = mem_lookup(m, to, name);
+  if(dir == NULL)
+    return -1;
+  if(!dir->isDir) {
+    errno = ENOTDIR;
+    return -1;
+  }
+  if(node_is_ancestor(node, dir)) { // can't move a directory into itself
+    errno = EINVAL;
+    return -1;
+  }
+
+  old = node_child(dir, name, strlen(name));
+  if(old == node)
+    return 0;
+  if(old != NULL) { // only a file may replace a file
+    if(old->isDir || node->isDir || old->refs > 0) {
+      errno = EEXIST;
+      return -1;
+    }
+    node_unlink(old);
+    node_free(m, old);
+  }
+
+  newName = strdup(name);
+  if(newName == NULL) {
+    errno = ENOMEM;
+    return -1;
+  }
+  free(node->name);
+  node->name = newName;
+
+  node->parent->mtime = ++m->clock;
+  node_unlink(node);
+  node_link(dir, node);
+  dir->mtime = m->clock;
+  return 0;
+}
+
+static int mem_chdir(void *ctx, const char *path) {
+  mem_fs_t   *m = ctx;
+  mem_node_t *node = mem_lookup(m, path, NULL);
+
+  if(node == NULL)
+    return -1;
+  if(!node->isDir) {
+    errno = ENOTDIR;
+    return -1;
+  }
+  m->cwd = node;
+  return 0;
+}
+
+// like the FAT driver, the cwd always ends with a '/'
+static char* mem_getcwd(void *ctx, char *buf, size_t size) {
+  mem_fs_t   *m = ctx;
+  mem_node_t *node;
+  size_t     len = 1;
+
+  for(node = m->cwd; node != m->root; node = node->parent)
+    len += strlen(node->name) + 1;
+
+  if(len + 1 > size) {
+    errno = ERANGE;
+    return NULL;
+  }
+
+  // fill from the end
+  buf[len] = 0;
+  buf[len-1] = '/';
+  for(node = m->cwd; node != m->root; node = node->parent) {
+    size_t n = strlen(node->name);
+    len -= n + 1;
+    memcpy(&buf[len], node->name, n);
+    buf[len-1] = '/';
+  }
+  return buf;
+}
+
+static void* mem_open(void *ctx, const char *path, const char *mode) {
+  mem_fs_t   *m = ctx;
+  char       name[NAME_MAX+1];
+  mem_node_t *dir = mem_lookup(m, path, name);
+  mem_node_t *node;
+  mem_file_t *fp;
+
+  if(dir == NULL)
+    return NULL;
+  if(!dir->isDir) {
+    errno = ENOTDIR;
+    return NULL;
+  }
+
+  node = node_child(dir, name, strlen(name));
+  if(node != NULL && node->isDir) {
+    errno = EISDIR;
+    return NULL;
+  }
+  if(node == NULL) {
+    if(mode[0] == 'r') {
+      errno = ENOENT;
+      return NULL;
+    }
+    node = node_new(m, dir, name, 0);
+    if(node == NULL)
+      return NULL;
+  }
+
+  fp = calloc(1, sizeof(mem_file_t));
+  if(fp == NULL) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  fp->node     = node;
+  fp->readable = mode[0] == 'r' || strchr(mode, '+') != NULL;
+  fp->writable = mode[0] != 'r' || strchr(mode, '+') != NULL;
+  fp->append   = mode[0] == 'a';
+  if(mode[0] == 'w') {
+    m->used    -= node->size;
+    node->size  = 0;
+    node->mtime = ++m->clock;
+  }
+  node->refs++;
+  return fp;
+}
+
+static ssize_t mem_read(void *ctx, void *p, void *buf, size_t len) {
+  mem_file_t *fp = p;
+
+  if(!fp->readable) {
+    errno = EBADF;
+    return -1;
+  }
+  if(fp->pos >= fp->node->size)
+    return 0;
+  if(len > fp->node->size - fp->pos)
+    len = fp->node->size - fp->pos;
+
+  memcpy(buf, fp->node->data + fp->pos, len);
+  fp->pos += len;
+  return len;
+}
+
+static ssize_t mem_write(void *ctx, void *p, const void *buf, size_t len) {
+  mem_fs_t   *m = ctx;
+  mem_file_t *fp = p;
+  mem_node_t *node = fp->node;
+
+  if(!fp->writable) {
+    errno = EBADF;
+    return -1;
+  }
+  if(len == 0)
+    return 0;
+  if(fp->append)
+    fp->pos = node->size;
+  if(fp->pos + len > node->size && m->used + (fp->pos + len - node->size) > m->capacity) {
+    errno = ENOSPC;
+    return -1;
+  }
+
+  if(fp->pos + len > node->cap) {
+    size_t        cap = node->cap ? node->cap : 512;
+    unsigned char *data;
+    while(cap < fp->pos + len)
+      cap *= 2;
+    data = realloc(node->data, cap);
+    if(data == NULL) {
+      errno = ENOSPC;
+      return -1;
+    }
+    node->data = data;
+    node->cap  = cap;
+  }
+
+  if(fp->pos > node->size) // fill the gap after a seek past the end
+    memset(node->data + node->size, 0, fp->pos - node->size);
+  memcpy(node->data + fp->pos, buf, len);
+  fp->pos += len;
+  if(fp->pos > node->size) {
+    m->used   += fp->pos - node->size;
+    node->size = fp->pos;
+  }
+  node->mtime = ++m->clock;
+  return len;
+}
+
+static int mem_close(void *ctx, void *p) {
+  mem_file_t *fp = p;
+  fp->node->refs--;
+  free(fp);
+  return 0;
+}
+
+static int mem_space(void *ctx, const char *path, uint64_t *avail) {
+  mem_fs_t *m = ctx;
+  if(mem_lookup(m, path, NULL) == NULL)
+    return -1;
+  *avail = m->capacity - m->used;
+  return 0;
+}
+
+static void mem_destroy(fs_backend_t *fs) {
+  mem_fs_t *m = fs->ctx;
+  node_free(m, m->root);
+  free(m);
+  free(fs);
+}
+
+fs_backend_t* fs_mem_create(void) {
+  fs_backend_t *fs = calloc(1, sizeof(fs_backend_t));
+  mem_fs_t     *m  = calloc(1, sizeof(mem_fs_t));
+
+  if(fs == NULL || m == NULL)
+    goto error;
+
+  m->root = node_new(m, NULL, "", 1);
+  if(m->root == NULL)
+    goto error;
+  m->cwd      = m->root;
+  m->capacity = UINT64_MAX;
+
+  fs->name     = "mem";
+  fs->ctx      = m;
+  fs->opendir  = mem_opendir;
+  fs->readdir  = mem_readdir;
+  fs->closedir = mem_closedir;
+  fs->stat     = mem_stat;
+  fs->mkdir    = mem_mkdir;
+  fs->remove   = mem_remove;
+  fs->rename   = mem_rename;
+  fs->chdir    = mem_chdir;
+  fs->getcwd   = mem_getcwd;
+  fs->open     = mem_open;
+  fs->read     = mem_read;
+  fs->write    = mem_write;
+  fs->close    = mem_close;
+  fs->space    = mem_space;
+  fs->destroy  = mem_destroy;
+  return fs;
+
+error:
+  free(m);
+  free(fs);
+  errno = ENOMEM;
+  return NULL;
+}
+
+void fs_mem_set_capacity(fs_backend_t *fs, uint64_t bytes) {
+  ((mem_fs_t*)fs->ctx)->capacity = bytes;
+}
@@ -0,0 +1,180 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fs.h"
+
+const fs_sdsim_params_t fs_sdsim_slow_card = {
+  .cmdLatency   = 3000,
+  .readLatency  = 1000,
+  .writeLatency = 10000,
+  .readRate     = 2*1024*1024,
+  .writeRate    = 1*1024*1024,
+  .delay        = NULL,
+};
+
+const fs_sdsim_params_t fs_sdsim_fast_card = {
+  .cmdLatency   = 500,
+  .readLatency  = 200,
+  .writeLatency = 1500,
+  .readRate     = 8*1024*1024,
+  .writeRate    = 5*1024*1024,
+  .delay        = NULL,
+};
+
+typedef struct {
+  fs_backend_t      *inner;
+  fs_sdsim_params_t params;
+  fs_sdsim_stats_t  stats;
+} sdsim_t;
+
+static void charge(sdsim_t *sd, uint32_t latency, size_t len, uint32_t rate) {
+  uint64_t us = latency;
+  if(rate != 0)
+    us += ((uint64_t)len*1000000 + rate - 1) / rate;
+
+  sd->stats.clock += us;
+  sd->stats.calls++;
+  if(sd->params.delay != NULL && us != 0)
+    sd->params.delay(us > UINT32_MAX ? UINT32_MAX : (uint32_t)us);
+}
+
+#define CMD(sd)   charge(sd, sd->params.cmdLatency, 0, 0)
+
+static void* sdsim_opendir(void *ctx, const char *path) {
+  sdsim_t *sd = ctx;
+  CMD(sd);
+  return sd->inner->opendir(sd->inner->ctx, path);
+}
+
+static struct dirent* sdsim_readdir(void *ctx, void *dp) {
+  sdsim_t *sd = ctx;
+  CMD(sd);
+  return sd->inner->readdir(sd->inner->ctx, dp);
+}
+
+static int sdsim_closedir(void *ctx, void *dp) {
+  sdsim_t *sd = ctx;
+  return sd->inner->closedir(sd->inner->ctx, dp);
+}
+
+static int sdsim_stat(void *ctx, const char *path, struct stat *st) {
+  sdsim_t *sd = ctx;
+  CMD(sd);
+  return sd->inner->stat(sd->inner->ctx, path, st);
+}
+
+static int sdsim_mkdir(void *ctx, const char *path) {
+  sdsim_t *sd = ctx;
+  CMD(sd);
+  return sd->inner->mkdir(sd->inner->ctx, path);
+}
+
+static int sdsim_remove(void *ctx, const char *path) {
+  sdsim_t *sd = ctx;
+  CMD(sd);
+  return sd->inner->remove(sd->inner->ctx, path);
+}
+
+static int sdsim_rename(void *ctx, const char *from, const char *to) {
+  sdsim_t *sd = ctx;
+  CMD(sd);
+  return sd->inner->rename(sd->inner->ctx, from, to);
+}
+
+static int sdsim_chdir(void *ctx, const char *path) {
+  sdsim_t *sd = ctx;
+  CMD(sd);
+  return sd->inner->chdir(sd->inner->ctx, path);
+}
+
+// the driver keeps the cwd in memory, so this is free
+static char* sdsim_getcwd(void *ctx, char *buf, size_t size) {
+  sdsim_t *sd = ctx;
+  return sd->inner->getcwd(sd->inner->ctx, buf, size);
+}
+
+static void* sdsim_open(void *ctx, const char *path, const char *mode) {
+  sdsim_t *sd = ctx;
+  CMD(sd);
+  return sd->inner->open(sd->inner->ctx, path, mode);
+}
+
+static ssize_t sdsim_read(void *ctx, void *fp, void *buf, size_t len) {
+  sdsim_t *sd = ctx;
+  ssize_t rc  = sd->inner->read(sd->inner->ctx, fp, buf, len);
+
+  charge(sd, sd->params.readLatency, rc > 0 ? rc : 0, sd->params.readRate);
+  if(rc > 0)
+    sd->stats.bytesRead += rc;
+  return rc;
+}
+
+static ssize_t sdsim_write(void *ctx, void *fp, const void *buf, size_t len) {
+  sdsim_t *sd = ctx;
+  ssize_t rc  = sd->inner->write(sd->inner->ctx, fp, buf, len);
+
+  charge(sd, sd->params.writeLatency, rc > 0 ? rc : 0, sd->params.writeRate);
+  if(rc > 0)
+    sd->stats.bytesWritten += rc;
+  return rc;
+}
+
+// closing flushes the last cluster and updates the directory entry
+static int sdsim_close(void *ctx, void *fp) {
+  sdsim_t *sd = ctx;
+  CMD(sd);
+  return sd->inner->close(sd->inner->ctx, fp);
+}
+
+static int sdsim_space(void *ctx, const char *path, uint64_t *avail) {
+  sdsim_t *sd = ctx;
+  CMD(sd);
+  return sd->inner->space(sd->inner->ctx, path, avail);
+}
+
+static void sdsim_destroy(fs_backend_t *fs) {
+  free(fs->ctx);
+  free(fs);
+}
+
+fs_backend_t* fs_sdsim_create(fs_backend_t *inner, const fs_sdsim_params_t *params) {
+  fs_backend_t *fs = calloc(1, sizeof(fs_backend_t));
+  sdsim_t      *sd = calloc(1, sizeof(sdsim_t));
+
+  if(fs == NULL || sd == NULL) {
+    free(sd);
+    free(fs);
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  sd->inner  = inner;
+  sd->params = params != NULL ? *params : fs_sdsim_slow_card;
+
+  fs->name     = "sdsim";
+  fs->ctx      = sd;
+  fs->opendir  = sdsim_opendir;
+  fs->readdir  = sdsim_readdir;
+  fs->closedir = sdsim_closedir;
+  fs->stat     = sdsim_stat;
+  fs->mkdir    = sdsim_mkdir;
+  fs->remove   = sdsim_remove;
+  fs->rename   = sdsim_rename;
+  fs->chdir    = sdsim_chdir;
+  fs->getcwd   = sdsim_getcwd;
+  fs->open     = sdsim_open;
+  fs->read     = sdsim_read;
+  fs->write    = sdsim_write;
+  fs->close    = sdsim_close;
+  fs->space    = sdsim_space;
+  fs->destroy  = sdsim_destroy;
+  return fs;
+}
+
+void fs_sdsim_stats(fs_backend_t *fs, fs_sdsim_stats_t *stats) {
+  *stats = ((sdsim_t*)fs->ctx)->stats;
+}
+
+void fs_sdsim_reset(fs_backend_t *fs) {
+  memset(&((sdsim_t*)fs->ctx)->stats, 0, sizeof(fs_sdsim_stats_t));
+}
@@ -4,12 +4,23 @@
 #include <sys/stat.h>
 #include <string.h>
 #include <errno.h>
+#include "fs.h"
 #include "scandir.h"
+#include "membudget.h"
 #include "mainapp.h"
 #include "gfx.h"
 
 IGuiManager* g_guiManager;
 
+#ifdef FS_SDSIM
+static fs_backend_t *sdsim = NULL;
+
+// really wait for the simulated card; the BIOS loop takes 4 cycles at 67 MHz
+static void sdsimDelay(u32 us) {
+  swiDelay((u32)((u64)us*67/4));
+}
+#endif
+
 typedef struct {
   u16 *src, *main, *sub;
   u32 len;
@@ -40,6 +51,13 @@ static icon_t icons[NUM_ICONS] = {
   [ICON_YES]    = { (u16*)yesTiles,     NULL, NULL, yesTilesLen,     },
 };
 
+// the icons themselves belong to the GUI manager, only the table is ours
+#define ICON_COST (sizeof(FileIconPtr) + sizeof(u8))
+
+static size_t evictIcons(void *ctx, size_t want) {
+  return ((MainApp*)ctx)->evictIcons(want);
+}
+
 MainApp::MainApp() {
   SetTitle("FeOS File Manager");
   SetIcon((color_t*)appiconBitmap);
@@ -54,14 +72,27 @@ MainApp::MainApp() {
   command = COMMAND_NONE;
   state = STATE_PROCESS_MAIN;
   pIcons = NULL;
+  iconLoaded = NULL;
+  numIcons = 0;
+  iconClient = mb_register("icons", ::evictIcons, this);
+  thumbs = NULL;
+  thumbMode = false;
+  debug = false;
+  debugTimer = 0;
+  transfer = NULL;
 }
 
 MainApp::~MainApp() {
+  closeThumbs();
   if(dirList != NULL)
   {
     freescandir(dirList, numDirs);
-    delete [] pIcons;
+    freeIcons();
   }
+  mb_unregister(iconClient);
+  // an unfinished transfer leaves its journal behind to be resumed
+  if(transfer != NULL)
+    transfer_free(transfer);
 }
 
 void MainApp::OnActivate() {
@@ -127,24 +158,127 @@ void MainApp::OnActivate() {
   icons[FIRST_FILE_ICON].sub = oamAllocateGfx(&oamSub, SpriteSize_16x16, SpriteColorFormat_Bmp);
 
   // reinitialize directory listing
+  rescan();
+  oamClear(&oamSub, 0, 1);
+
+  keysSetRepeat(15, 4);
+}
+
+// icons are fetched as their rows are drawn, see getIcon()
+void MainApp::loadIcons() {
+  pIcons     = NULL;
+  iconLoaded = NULL;
+  numIcons   = 0;
+  if(numDirs <= 0)
+    return;
+
+  // without room for the cache every icon is fetched uncached. the table
+  // only counts once pIcons is set, so evictIcons() can't pull it out from
+  // under us here
+  if(mb_reserve(iconClient, numDirs*sizeof(FileIconPtr)) != 0)
+    return;
+  iconLoaded = (u8*)mb_malloc(iconClient, numDirs);
+  if(iconLoaded == NULL) {
+    mb_release(iconClient, numDirs*sizeof(FileIconPtr));
+    return;
+  }
+  memset(iconLoaded, 0, numDirs);
+  pIcons   = new FileIconPtr[numDirs];
+  numIcons = numDirs;
+}
+
+void MainApp::freeIcons() {
+  if(pIcons != NULL) {
+    delete [] pIcons;
+    mb_release(iconClient, numIcons*sizeof(FileIconPtr));
+  }
+  mb_free(iconClient, iconLoaded);
+  pIcons     = NULL;
+  iconLoaded = NULL;
+  numIcons   = 0;
+}
+
+FileIconPtr MainApp::getIcon(int i) {
+  if(pIcons == NULL || i >= numIcons)
+    return g_guiManager->GetFileIcon(dirList[i]->d_name);
+
+  if(!iconLoaded[i]) {
+    pIcons[i]     = g_guiManager->GetFileIcon(dirList[i]->d_name);
+    iconLoaded[i] = 1;
+  }
+  return pIcons[i];
+}
+
+// drop the whole table, icons are then looked up every time they are drawn
+size_t MainApp::evictIcons(size_t want) {
+  size_t freed = numIcons*ICON_COST;
+
+  // nothing to give back while loadIcons() is still setting the table up
+  if(pIcons == NULL)
+    return 0;
+  freeIcons();
+  return freed;
+}
+
+void MainApp::openThumbs() {
+  if(thumbMode && dirList != NULL)
+    thumbs = thumbs_open(dirList, numDirs);
+}
+
+// the cache file is written when leaving the folder
+void MainApp::closeThumbs() {
+  if(thumbs != NULL) {
+    thumbs_save(thumbs);
+    thumbs_close(thumbs);
+    thumbs = NULL;
+  }
+}
+
+// decode thumbnails a little each frame, visible rows first
+#define THUMB_STEP (16*1024)
+
+void MainApp::updateThumbs() {
+  int    last   = scroll + NUM_ENTRIES < numDirs ? scroll + NUM_ENTRIES : numDirs;
+  size_t budget = THUMB_STEP;
+  int    i;
+
+  while((i = thumbs_step(thumbs, scroll, last, &budget)) != -1) {
+    if(i >= scroll && i < last && thumbs_get(thumbs, i) != NULL)
+      dmaCopy(thumbs_get(thumbs, i), icons[FIRST_FILE_ICON + i - scroll].main, folderBitmapLen);
+    if(i == selected)
+      info.stale = true;
+  }
+}
+
+void MainApp::rescan() {
+  closeThumbs();
   if(dirList != NULL) {
     freescandir(dirList, numDirs);
-    delete [] pIcons;
+    freeIcons();
   }
 
   numDirs = scandir(".", &dirList, generic_scandir_filter, generic_scandir_compar);
-  selected = -1;
-  scroll   = 0;
+  if(numDirs < 0) {
+    // list only "..", so there is still a way back out
+    surface_t surface = { status.buf + 16, 256 - 16*2, 48, 256, };
+    char      str[256];
+    sprintf(str, "Failed to read directory: %s", strerror(errno));
+    dmaFillHalfWords(Colors::Transparent, status.buf, status.size);
+    font->PrintText(&surface, 0, 16-4, str, Colors::Black, PrintTextFlags::AtBaseline);
+    statusTimer = 180;
+    numDirs = parentscandir(&dirList);
+    if(numDirs < 0)
+      numDirs = 0;
+  }
   loadIcons();
-  oamClear(&oamSub, 0, 1);
-
-  keysSetRepeat(15, 4);
-}
+  openThumbs();
 
-void MainApp::loadIcons() {
-  pIcons = new FileIconPtr[numDirs];
-  for (int i = 0; i < numDirs; i ++)
-    pIcons[i] = g_guiManager->GetFileIcon(dirList[i]->d_name);
+  // reset the selected direntry and scroll
+  selected     = -1;
+  scroll       = 0;
+  cwdstr.stale = true;
+  info.stale   = true;
+  list.stale   = true;
 }
 
 void MainApp::OnDeactivate() {
@@ -154,6 +288,7 @@ void MainApp::OnVBlank() {
   touchPosition touch;
   word_t        down   = keysDown();
   word_t        repeat = keysDownRepeat();
+  bool          busy   = state == STATE_COPY || state == STATE_MOVE;
 
   if(down & KEY_TOUCH)
     touchRead(&touch);
@@ -169,6 +304,31 @@ void MainApp::OnVBlank() {
       dmaFillHalfWords(0, status.buf, status.size);
   }
 
+  // memory usage overlay
+  if(down & KEY_SELECT) {
+    debug = !debug;
+    debugTimer = 0;
+    if(!debug && statusTimer == 0)
+      dmaFillHalfWords(0, status.buf, status.size);
+  }
+  if(debug && statusTimer == 0 && !busy && state != STATE_DELETE && --debugTimer <= 0) {
+    redrawDebug();
+    debugTimer = 30;
+  }
+
+  // thumbnail mode, the card is left to a running transfer
+  if((down & KEY_X) && !busy) {
+    thumbMode = !thumbMode;
+    if(thumbMode)
+      openThumbs();
+    else
+      closeThumbs();
+    list.stale = true;
+    info.stale = true;
+  }
+  if(thumbs != NULL && !busy)
+    updateThumbs();
+
   oamClear(&oamSub, 1, 7);
 
   switch(state) {
@@ -204,8 +364,8 @@ void MainApp::OnVBlank() {
     list.stale = true;
   }
 
-  // check for exit
-  if(down & KEY_B) {
+  // check for exit, B cancels a transfer instead
+  if((down & KEY_B) && !busy) {
     Close();
     return;
   }
@@ -251,27 +411,17 @@ void MainApp::processMainScreen(touchPosition &touch, int down, int repeat) {
           // open a directory
           if(TYPE_DIR(dirList[selected]->d_type)) {
             strcpy(directory, dirList[selected]->d_name);
-            freescandir(dirList, numDirs);
-            delete [] pIcons;
 
             // move to the new directory
-            chdir(directory);
+            fs_chdir(directory);
 
             // scan the new directory
-            numDirs = scandir(".", &dirList, generic_scandir_filter, generic_scandir_compar);
-            loadIcons();
-
-            // reset the selected direntry and scroll
-            selected     = -1;
-            scroll       = 0;
-            cwdstr.stale = true;
-            info.stale   = true;
-            list.stale   = true;
+            rescan();
             return;
           }
           else {
             char tmpBuf[256];
-            getcwd(tmpBuf, sizeof(tmpBuf));
+            fs_getcwd(tmpBuf, sizeof(tmpBuf));
             strncat(tmpBuf, dirList[selected]->d_name, sizeof(tmpBuf));
             g_guiManager->OpenFile(tmpBuf);
           }
@@ -350,6 +500,7 @@ void MainApp::redrawList() {
 
   // clear all the sprites
   oamClear(&oamMain, 0, 11);
+  mb_touch(iconClient);
 
   // clear the list
   dmaFillWords(Colors::Transparent, list.buf, list.size);
@@ -372,9 +523,54 @@ void MainApp::redrawList() {
     // this is a directory, give it a folder sprite!
     if(TYPE_DIR(dirList[scroll+i]->d_type))
       dmaCopy(folderBitmap, gfxPtr, folderBitmapLen);
+	else if(thumbs != NULL && thumbs_get(thumbs, scroll+i) != NULL)
+	  dmaCopy(thumbs_get(thumbs, scroll+i), gfxPtr, folderBitmapLen);
 	else
-	  dmaCopy(pIcons[scroll+i]->GetData(), gfxPtr, folderBitmapLen);
+	  dmaCopy(getIcon(scroll+i)->GetData(), gfxPtr, folderBitmapLen);
+  }
+}
+
+void MainApp::redrawDebug() {
+  surface_t  surface = { status.buf + 16, 256 - 16*2, 48, 256, };
+  mb_stats_t stats;
+  char       str[256];
+  int        n = 0;
+
+  sprintf(str, "Memory: %u of %u KB", (u32)(mb_used()/1024), (u32)(mb_limit()/1024));
+#ifdef FS_SDSIM
+  fs_sdsim_stats_t card;
+  fs_sdsim_stats(sdsim, &card);
+  sprintf(str+strlen(str), ", card %u.%02u s", (u32)(card.clock/1000000), (u32)(card.clock%1000000/10000));
+#endif
+  for(int i = 0; i < MB_MAX_CLIENTS; i++) {
+    if(mb_stats(i, &stats) == 0)
+      sprintf(str+strlen(str), "%s%s %u/%u KB", n++ % 2 ? ", " : "\n", stats.name,
+              (u32)((stats.used+1023)/1024), (u32)((stats.peak+1023)/1024));
   }
+
+  dmaFillHalfWords(Colors::Transparent, status.buf, status.size);
+  font->PrintText(&surface, 0, 16-4, str, Colors::Black, PrintTextFlags::AtBaseline);
+}
+
+static void sizeString(char *str, u64 size) {
+  if(size < 1000)
+    sprintf(str, "%u byte%c", (u32)size, size != 1 ? 's' : ' ');
+  else if(size < 10240)
+    sprintf(str, "%u.%02u KB", (u32)(size/1024),
+                         (u32)((size%1024)*100/1024));
+  else if(size < 102400)
+    sprintf(str, "%u.%01u KB", (u32)(size/1024),
+                         (u32)((size%1024)*10/1024));
+  else if(size < 1000000)
+    sprintf(str, "%u KB", (u32)(size/1024));
+  else if(size < 10485760)
+    sprintf(str, "%u.%02u MB", (u32)(size/1048576),
+                         (u32)((size%1048576)*100/1048576));
+  else if(size < 104857600)
+    sprintf(str, "%u.%01u MB", (u32)(size/1048576),
+                         (u32)((size%1048576)*10/1048576));
+  else
+    sprintf(str, "%u MB", (u32)(size/1048576));
 }
 
 void MainApp::redrawInfo() {
@@ -390,35 +586,22 @@ void MainApp::redrawInfo() {
   if(selected == -1)
     return;
 
-  stat(dirList[selected]->d_name, &statbuf);
+  fs_stat(dirList[selected]->d_name, &statbuf);
 
   sprintf(str, "%s\n", dirList[selected]->d_name);
   u16* gfxPtr = icons[FIRST_FILE_ICON].sub;
   oamSet(&oamSub, 0, 14, 18, 0, 15, SpriteSize_16x16, SpriteColorFormat_Bmp,
          gfxPtr, -1, false, false, false, false, false);
   if(!TYPE_DIR(dirList[selected]->d_type)) {
-    dmaCopy(pIcons[selected]->GetData(), gfxPtr, folderBitmapLen);
+    if(thumbs != NULL && thumbs_get(thumbs, selected) != NULL)
+      dmaCopy(thumbs_get(thumbs, selected), gfxPtr, folderBitmapLen);
+    else
+      dmaCopy(getIcon(selected)->GetData(), gfxPtr, folderBitmapLen);
     int tmpLen = strlen(str);
     g_guiManager->GetFileDescription(dirList[selected]->d_name, str + tmpLen, sizeof(str)-tmpLen);
     strncat(str, "\nSize: ", sizeof(str));
-    if(statbuf.st_size < 1000)
-      sprintf(str+strlen(str), "%u byte%c\n", statbuf.st_size, statbuf.st_size != 1 ? 's' : ' ');
-    else if(statbuf.st_size < 10240)
-      sprintf(str+strlen(str), "%u.%02u KB\n", statbuf.st_size/1024,
-                           (statbuf.st_size%1024)*100/1024);
-    else if(statbuf.st_size < 102400)
-      sprintf(str+strlen(str), "%u.%01u KB\n", statbuf.st_size/1024,
-                           (statbuf.st_size%1024)*10/1024);
-    else if(statbuf.st_size < 1000000)
-      sprintf(str+strlen(str), "%u KB\n", statbuf.st_size/1024);
-    else if(statbuf.st_size < 10485760)
-      sprintf(str+strlen(str), "%u.%02u MB\n", statbuf.st_size/1048576,
-                           (statbuf.st_size%1048576)*100/1048576);
-    else if(statbuf.st_size < 104857600)
-      sprintf(str+strlen(str), "%u.%01u MB\n", statbuf.st_size/1048576,
-                           (statbuf.st_size%1048576)*10/1048576);
-    else
-      sprintf(str+strlen(str), "%u MB\n", statbuf.st_size/1048576);
+    sizeString(str+strlen(str), statbuf.st_size);
+    strcat(str, "\n");
   }
   else {
     dmaCopy(folderBitmap, gfxPtr, folderBitmapLen);
@@ -436,7 +619,7 @@ void MainApp::redrawCwd() {
 
   cwdstr.stale = false;
 
-  getcwd(cwd, sizeof(cwd));
+  fs_getcwd(cwd, sizeof(cwd));
   dmaFillHalfWords(Colors::Transparent, cwdstr.buf, cwdstr.size);
   font->PrintText(&surface, 0, 16-1, cwd, Colors::Black, PrintTextFlags::AtBaseline);
 }
@@ -449,18 +632,105 @@ static char buf[4096];
 #define NO_Y  YES_Y
 
 void MainApp::Copy(touchPosition &touch, int down, int repeat) {
-  surface_t surface = { status.buf + 16, 256 - 16*2, 48, 256, };
+  Transfer(down, false);
+}
+
+void MainApp::Move(touchPosition &touch, int down, int repeat) {
+  Transfer(down, true);
+}
+
+// copy or move the clipboard file into the cwd, a little each frame
+#define TRANSFER_STEP (64*1024)
+
+void MainApp::Transfer(int down, bool move) {
+  surface_t  surface = { status.buf + 16, 256 - 16*2, 48, 256, };
+  char       dst[FILENAME_MAX];
+  char       done[16], total[16];
+  const char *name;
+  u32        eta;
+
+  name = strrchr(file, '/');
+  name = name != NULL ? name+1 : file;
 
-  // print status message
   dmaFillHalfWords(Colors::Transparent, status.buf, status.size);
-  strcpy(buf, "This operation is not implemented yet.");
+  statusTimer = 0;
+
+  if(transfer == NULL) {
+    if(strlen(cwd) > 0 && cwd[strlen(cwd)-1] == '/')
+      snprintf(dst, sizeof(dst), "%s%s", cwd, name);
+    else
+      snprintf(dst, sizeof(dst), "%s/%s", cwd, name);
+
+    transfer = transfer_start(file, dst, move);
+    if(transfer == NULL) {
+      sprintf(buf, "Failed to %s %s: %s", move ? "move" : "copy", name, strerror(errno));
+      font->PrintText(&surface, 0, 16-4, buf, Colors::Black, PrintTextFlags::AtBaseline);
+      statusTimer = 180;
+      state = STATE_PROCESS_MAIN;
+      command = move ? COMMAND_CUT : COMMAND_COPY;
+      return;
+    }
+  }
+
+  if(down & KEY_B) {
+    // the journal lets the next paste pick up from here
+    transfer_free(transfer);
+    transfer = NULL;
+    command = move ? COMMAND_CUT : COMMAND_COPY;
+    sprintf(buf, "Cancelled %s of %s\nPaste again to resume", move ? "move" : "copy", name);
+    font->PrintText(&surface, 0, 16-4, buf, Colors::Black, PrintTextFlags::AtBaseline);
+    statusTimer = 180;
+    state = STATE_PROCESS_MAIN;
+    rescan();
+    return;
+  }
+
+  // the ETA only counts time spent copying and removing
+  transfer_phase_t phase = transfer->phase;
+  transfer_step(transfer, TRANSFER_STEP);
+  if(phase == TRANSFER_PLAN && transfer->phase != TRANSFER_PLAN)
+    transferStart = time(NULL);
+
+  switch(transfer->phase) {
+    case TRANSFER_PLAN:
+      sizeString(total, transfer->totalBytes);
+      sprintf(buf, "Scanning %s...\n%d items, %s", name, transfer->numItems, total);
+      break;
+
+    case TRANSFER_COPY:
+    case TRANSFER_REMOVE:
+      sizeString(done,  transfer->doneBytes);
+      sizeString(total, transfer->totalBytes);
+      eta = transfer_eta(transfer, time(NULL) - transferStart);
+      sprintf(buf, "%s %s%s\n%d of %d items, %s of %s\n",
+              move ? "Moving" : "Copying", name, transfer->resumed ? " (resumed)" : "",
+              transfer->phase == TRANSFER_COPY ? transfer->current : transfer->numItems,
+              transfer->numItems, done, total);
+      if(eta > 0)
+        sprintf(buf+strlen(buf), "%u:%02u left, B to cancel", eta/60, eta%60);
+      else
+        strcat(buf, "B to cancel");
+      break;
+
+    case TRANSFER_DONE:
+      sprintf(buf, "Successfully %s %s", move ? "moved" : "copied", name);
+      break;
+
+    case TRANSFER_ERROR:
+      sprintf(buf, "Failed to %s %s: %s", move ? "move" : "copy", name, strerror(transfer->error));
+      // keep the clipboard so pasting again retries from the journal
+      command = move ? COMMAND_CUT : COMMAND_COPY;
+      break;
+  }
   font->PrintText(&surface, 0, 16-4, buf, Colors::Black, PrintTextFlags::AtBaseline);
-  statusTimer = 180;
-  state = STATE_PROCESS_MAIN;
-}
 
-void MainApp::Move(touchPosition &touch, int down, int repeat) {
-  Copy(touch, down, repeat);
+  if(transfer->phase == TRANSFER_DONE || transfer->phase == TRANSFER_ERROR) {
+    transfer_free(transfer);
+    transfer = NULL;
+    statusTimer = 180;
+    state = STATE_PROCESS_MAIN;
+    rescan();
+  }
 }
 
 void MainApp::Delete(touchPosition &touch, int down, int repeat) {
@@ -504,7 +774,7 @@ void MainApp::Delete(touchPosition &touch, int down, int repeat) {
   // delete if choice was YES
   if(choice == YES) {
     // TODO: recursive delete for directories
-    rc = remove(dirList[selected]->d_name);
+    rc = fs_remove(dirList[selected]->d_name);
     if(rc == -1)
       sprintf(buf, "Failed to delete %s: %s", dirList[selected]->d_name, strerror(errno));
     else {
@@ -512,12 +782,17 @@ void MainApp::Delete(touchPosition &touch, int down, int repeat) {
 
       // hack to prevent another scandir!
       // free the dirent
-      free(dirList[selected]);
+      freescandirent(dirList[selected]);
       // slide everything after it 1 space down (if it's not the last entry)
       if(selected != numDirs-1)
         memmove(&dirList[selected], &dirList[selected+1], (numDirs-selected-1)*sizeof(struct dirent *));
       // decrement the dirlist counter
       numDirs--;
+      // the icons are indexed like the list, so start over
+      freeIcons();
+      loadIcons();
+      if(thumbs != NULL)
+        thumbs_remove(thumbs, selected);
       // list needs to be updated
       list.stale = true;
       // we just deleted the selected entry!
@@ -535,16 +810,34 @@ void MainApp::Delete(touchPosition &touch, int down, int repeat) {
 }
 
 void MainApp::Rename(touchPosition &touch, int down, int repeat) {
-  Copy(touch, down, repeat);
+  surface_t surface = { status.buf + 16, 256 - 16*2, 48, 256, };
+
+  // print status message
+  dmaFillHalfWords(Colors::Transparent, status.buf, status.size);
+  strcpy(buf, "This operation is not implemented yet.");
+  font->PrintText(&surface, 0, 16-4, buf, Colors::Black, PrintTextFlags::AtBaseline);
+  statusTimer = 180;
+  state = STATE_PROCESS_MAIN;
 }
 
 int main() {
   g_guiManager = GetGuiManagerChecked();
 
+#ifdef FS_SDSIM
+  // make the real card behave like a slow one, the debug view shows its time
+  fs_sdsim_params_t params = fs_sdsim_slow_card;
+  params.delay = sdsimDelay;
+  sdsim = fs_sdsim_create(fs_posix_backend(), &params);
+  fs_set_backend(sdsim);
+#endif
+
   MainApp *app = new MainApp();
   g_guiManager->RunApplication(app);
 
   delete app;
+#ifdef FS_SDSIM
+  fs_destroy(sdsim);
+#endif
 
   return 0;
 }
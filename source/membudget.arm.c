@@ -0,0 +1,210 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "membudget.h"
+
+typedef struct {
+  int        active;
+  const char *name;
+  mb_evict_t evict;
+  void       *ctx;
+  size_t     used;
+  size_t     peak;
+  unsigned   evictions;
+  unsigned   lastUse;
+} client_t;
+
+// every block remembers its size so it can be uncharged on free
+typedef union {
+  size_t    size;
+  long long align;
+  double    alignf;
+} header_t;
+
+static client_t clients[MB_MAX_CLIENTS];
+static size_t   limit = MB_DEFAULT_LIMIT;
+static size_t   used  = 0;
+static unsigned tick  = 0;
+
+#define VALID(id) ((id) >= 0 && (id) < MB_MAX_CLIENTS && clients[id].active)
+
+int mb_register(const char *name, mb_evict_t evict, void *ctx) {
+  int i;
+  for(i = 0; i < MB_MAX_CLIENTS; i++) {
+    if(!clients[i].active) {
+      memset(&clients[i], 0, sizeof(client_t));
+      clients[i].active  = 1;
+      clients[i].name    = name;
+      clients[i].evict   = evict;
+      clients[i].ctx     = ctx;
+      clients[i].lastUse = ++tick;
+      return i;
+    }
+  }
+  return -1;
+}
+
+// anything still charged to the client stays in the global total
+void mb_unregister(int id) {
+  if(VALID(id))
+    clients[id].active = 0;
+}
+
+void mb_set_limit(size_t bytes) {
+  limit = bytes;
+}
+
+size_t mb_limit(void) {
+  return limit;
+}
+
+size_t mb_used(void) {
+  return used;
+}
+
+void mb_touch(int id) {
+  if(VALID(id))
+    clients[id].lastUse = ++tick;
+}
+
+// shrink caches, least recently used first and the largest of those, until
+// size more bytes fit in the budget. if the heap itself is exhausted (force),
+// stop after the first cache that gave something back so the caller retries
+static int make_room(size_t size, int force) {
+  unsigned tried = 0;
+
+  while(force || used + size > limit) {
+    client_t *victim = NULL;
+    size_t   want, freed;
+    int      i;
+
+    for(i = 0; i < MB_MAX_CLIENTS; i++) {
+      client_t *c = &clients[i];
+      if(!c->active || c->evict == NULL || c->used == 0 || (tried & (1 << i)))
+        continue;
+      if(victim == NULL || c->lastUse < victim->lastUse
+      || (c->lastUse == victim->lastUse && c->used > victim->used))
+        victim = c;
+    }
+    if(victim == NULL)
+      return -1;
+
+    want  = force ? size : used + size - limit;
+    freed = victim->evict(victim->ctx, want);
+    victim->evictions++;
+    if(freed == 0)
+      tried |= 1 << (victim - clients);
+    else if(force)
+      return 0;
+  }
+
+  return 0;
+}
+
+// memory which can't be dropped is never refused, it only pushes caches out
+static int charge(int id, size_t size) {
+  if(used + size > limit && make_room(size, 0) != 0
+  && !(VALID(id) && clients[id].evict == NULL)) {
+    errno = ENOMEM;
+    return -1;
+  }
+
+  used += size;
+  if(VALID(id)) {
+    clients[id].used += size;
+    if(clients[id].used > clients[id].peak)
+      clients[id].peak = clients[id].used;
+    clients[id].lastUse = ++tick;
+  }
+  return 0;
+}
+
+static void uncharge(int id, size_t size) {
+  used -= size;
+  if(VALID(id))
+    clients[id].used -= size;
+}
+
+int mb_reserve(int id, size_t size) {
+  return charge(id, size);
+}
+
+void mb_release(int id, size_t size) {
+  uncharge(id, size);
+}
+
+void* mb_malloc(int id, size_t size) {
+  header_t *h;
+
+  if(charge(id, size) != 0)
+    return NULL;
+
+  while((h = malloc(sizeof(header_t) + size)) == NULL) {
+    if(make_room(size, 1) != 0) {
+      uncharge(id, size);
+      errno = ENOMEM;
+      return NULL;
+    }
+  }
+
+  h->size = size;
+  return h + 1;
+}
+
+void* mb_realloc(int id, void *ptr, size_t size) {
+  header_t *h, *temp;
+  size_t   old;
+
+  if(ptr == NULL)
+    return mb_malloc(id, size);
+
+  h   = (header_t*)ptr - 1;
+  old = h->size;
+
+  if(size > old && charge(id, size - old) != 0)
+    return NULL;
+
+  while((temp = realloc(h, sizeof(header_t) + size)) == NULL) {
+    if(make_room(size, 1) != 0) {
+      if(size > old)
+        uncharge(id, size - old);
+      errno = ENOMEM;
+      return NULL;
+    }
+  }
+
+  if(size < old)
+    uncharge(id, old - size);
+  temp->size = size;
+  return temp + 1;
+}
+
+void mb_free(int id, void *ptr) {
+  header_t *h;
+
+  if(ptr == NULL)
+    return;
+
+  h = (header_t*)ptr - 1;
+  uncharge(id, h->size);
+  free(h);
+}
+
+char* mb_strdup(int id, const char *str) {
+  size_t len = strlen(str) + 1;
+  char   *p  = mb_malloc(id, len);
+  if(p != NULL)
+    memcpy(p, str, len);
+  return p;
+}
+
+int mb_stats(int id, mb_stats_t *stats) {
+  if(!VALID(id))
+    return -1;
+
+  stats->name      = clients[id].name;
+  stats->used      = clients[id].used;
+  stats->peak      = clients[id].peak;
+  stats->evictions = clients[id].evictions;
+  return 0;
+}
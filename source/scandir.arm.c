@@ -3,12 +3,18 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include "fs.h"
+#include "membudget.h"
 
 //minimum space needed to fit dirent with name and fit on 4-byte boundary
 #define DENTSIZE(dent) (sizeof(struct dirent) - sizeof(dent->d_name) + ((strlen(dent->d_name) + 1 + 4) & ~3))
 
 #define TYPE_DIR(n) (n == DT_DIR ? 1 : 0)
 
+// directory listings are charged to the memory budget, but can't be evicted
+// and so are never refused for it
+static int listing = -1;
+
 int scandir(const char *dir,
             struct dirent ***dirList,
             int(*filter)(const struct dirent *),
@@ -18,17 +24,20 @@ int scandir(const char *dir,
   struct dirent *dent;
   int numEntries = 0;
 
-  DIR *dp = opendir(dir);
+  if(listing < 0)
+    listing = mb_register("listing", NULL, NULL);
+
+  void *dp = fs_opendir(dir);
   if(dp == NULL)
     goto error;
 
-  while((dent = readdir(dp)) != NULL) { //read all the directory entries
+  while((dent = fs_readdir(dp)) != NULL) { //read all the directory entries
     if(filter == NULL  //filter out nothing
     || filter(dent)) { //filter out unwanted entries
-      temp = realloc(pList, sizeof(struct dirent*)*(numEntries+1)); //increase size of list
+      temp = mb_realloc(listing, pList, sizeof(struct dirent*)*(numEntries+1)); //increase size of list
       if(temp) {
         pList = temp;
-        pList[numEntries] = malloc(DENTSIZE(dent));
+        pList[numEntries] = mb_malloc(listing, DENTSIZE(dent));
         if(pList[numEntries]) {
           memcpy(pList[numEntries], dent, DENTSIZE(dent));
           numEntries++;
@@ -40,31 +49,62 @@ int scandir(const char *dir,
   }
 
   //sort the list
-  if(compar != NULL)
+  if(compar != NULL && pList != NULL)
     qsort(pList, numEntries, sizeof(struct dirent*), (int (*)(const void*, const void*))compar);
 
-  closedir(dp);
+  fs_closedir(dp);
   *dirList = pList;
   return numEntries;
 
 error:
   if(dp != NULL)
-    closedir(dp);
+    fs_closedir(dp);
   if(pList) { //clean up the list
     int i;
     for(i = 0; i < numEntries; i++)
-      free(pList[i]);
-    free(pList);
+      mb_free(listing, pList[i]);
+    mb_free(listing, pList);
   }
   *dirList = NULL;
   return -1;
 }
 
+// a listing holding only "..", for a folder which can't be read
+int parentscandir(struct dirent ***dirList) {
+  struct dirent parent;
+  struct dirent *dent = &parent;
+  struct dirent **pList;
+
+  if(listing < 0)
+    listing = mb_register("listing", NULL, NULL);
+
+  memset(dent, 0, sizeof(struct dirent));
+  strcpy(dent->d_name, "..");
+  dent->d_type = DT_DIR;
+
+  *dirList = NULL;
+  pList = mb_malloc(listing, sizeof(struct dirent*));
+  if(pList == NULL)
+    return -1;
+  pList[0] = mb_malloc(listing, DENTSIZE(dent));
+  if(pList[0] == NULL) {
+    mb_free(listing, pList);
+    return -1;
+  }
+  memcpy(pList[0], dent, DENTSIZE(dent));
+  *dirList = pList;
+  return 1;
+}
+
 void freescandir(struct dirent **dirList, int numEntries) {
   int i;
   for(i = 0; i < numEntries; i++)
-    free(dirList[i]);
-  free(dirList);
+    mb_free(listing, dirList[i]);
+  mb_free(listing, dirList);
+}
+
+void freescandirent(struct dirent *dent) {
+  mb_free(listing, dent);
 }
 
 int generic_scandir_filter(const struct dirent* dent) {
@@ -0,0 +1,1522 @@
+#include <stdio.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "fs.h"
+#include "membudget.h"
+#include "thumbs.h"
+
+#define THUMB_MAX_DIM  4096
+#define THUMB_BUFSIZE  1024
+#define THUMB_MAGIC    "XBT1"
+
+// bytes of image data a stat is worth against the step budget
+#define THUMB_CHECK_COST 1024
+
+// sprite bitmap format
+#define PIXEL(r, g, b) ((r)>>3 | ((g)>>3)<<5 | ((b)>>3)<<10 | 1<<15)
+#define OPAQUE         0xFF000000
+
+static int client = -1;
+
+int thumb_is_image(const char *name) {
+  const char *ext = strrchr(name, '.');
+  return ext != NULL && (stricmp(ext, ".bmp") == 0 || stricmp(ext, ".png") == 0 || stricmp(ext, ".grf") == 0);
+}
+
+static size_t spend(size_t budget, size_t cost) {
+  return budget > cost ? budget - cost : 0;
+}
+
+// Box filter
+//
+// Source rows are streamed in one at a time as 0xAARRGGBB with alpha either
+// 0 or 0xFF. Each destination pixel averages the opaque source pixels of its
+// box; it is only opaque if at least half of the box is. An image without
+// any opaque pixel has no alpha at all and is averaged as a whole.
+typedef struct {
+  int      dstW, dstH;
+  int      offX, offY;
+  int      opaque;
+  int      x0[THUMB_SIZE], x1[THUMB_SIZE];
+  int      y0[THUMB_SIZE], y1[THUMB_SIZE];
+  uint32_t r[THUMB_PIXELS], g[THUMB_PIXELS], b[THUMB_PIXELS];
+  uint32_t n[THUMB_PIXELS], total[THUMB_PIXELS];
+  uint32_t allR[THUMB_PIXELS], allG[THUMB_PIXELS], allB[THUMB_PIXELS];
+} downscale_t;
+
+static void downscale_init(downscale_t *ds, int w, int h) {
+  int i;
+
+  memset(ds, 0, sizeof(downscale_t));
+
+  // keep the aspect ratio and center
+  if(w >= h) {
+    ds->dstW = THUMB_SIZE;
+    ds->dstH = h*THUMB_SIZE/w > 0 ? h*THUMB_SIZE/w : 1;
+  }
+  else {
+    ds->dstW = w*THUMB_SIZE/h > 0 ? w*THUMB_SIZE/h : 1;
+    ds->dstH = THUMB_SIZE;
+  }
+  ds->offX = (THUMB_SIZE - ds->dstW)/2;
+  ds->offY = (THUMB_SIZE - ds->dstH)/2;
+
+  // boxes are never empty, so small images are scaled up
+  for(i = 0; i < ds->dstW; i++) {
+    ds->x0[i] = i*w/ds->dstW;
+    ds->x1[i] = (i+1)*w/ds->dstW > ds->x0[i] ? (i+1)*w/ds->dstW : ds->x0[i]+1;
+  }
+  for(i = 0; i < ds->dstH; i++) {
+    ds->y0[i] = i*h/ds->dstH;
+    ds->y1[i] = (i+1)*h/ds->dstH > ds->y0[i] ? (i+1)*h/ds->dstH : ds->y0[i]+1;
+  }
+}
+
+static void downscale_row(downscale_t *ds, int y, const uint32_t *row) {
+  uint32_t r[THUMB_SIZE], g[THUMB_SIZE], b[THUMB_SIZE], n[THUMB_SIZE];
+  uint32_t allR[THUMB_SIZE], allG[THUMB_SIZE], allB[THUMB_SIZE];
+  int      dx, dy, x;
+
+  // sum the row into columns once, then add it to every box row it is in
+  for(dx = 0; dx < ds->dstW; dx++) {
+    uint32_t sr = 0, sg = 0, sb = 0, sn = 0, ar = 0, ag = 0, ab = 0;
+    for(x = ds->x0[dx]; x < ds->x1[dx]; x++) {
+      uint32_t p = row[x];
+      ar += (p >> 16) & 0xFF;
+      ag += (p >>  8) & 0xFF;
+      ab +=  p        & 0xFF;
+      if(p & OPAQUE) {
+        sr += (p >> 16) & 0xFF;
+        sg += (p >>  8) & 0xFF;
+        sb +=  p        & 0xFF;
+        sn++;
+      }
+    }
+    r[dx] = sr;
+    g[dx] = sg;
+    b[dx] = sb;
+    n[dx] = sn;
+    allR[dx] = ar;
+    allG[dx] = ag;
+    allB[dx] = ab;
+    if(sn > 0)
+      ds->opaque = 1;
+  }
+
+  for(dy = 0; dy < ds->dstH; dy++) {
+    int i = dy*THUMB_SIZE;
+    if(y < ds->y0[dy] || y >= ds->y1[dy])
+      continue;
+    for(dx = 0; dx < ds->dstW; dx++, i++) {
+      ds->r[i]     += r[dx];
+      ds->g[i]     += g[dx];
+      ds->b[i]     += b[dx];
+      ds->n[i]     += n[dx];
+      ds->allR[i]  += allR[dx];
+      ds->allG[i]  += allG[dx];
+      ds->allB[i]  += allB[dx];
+      ds->total[i] += ds->x1[dx] - ds->x0[dx];
+    }
+  }
+}
+
+static void downscale_finish(downscale_t *ds, uint16_t *pixels) {
+  int dx, dy;
+
+  memset(pixels, 0, THUMB_PIXELS*sizeof(uint16_t));
+  for(dy = 0; dy < ds->dstH; dy++) {
+    for(dx = 0; dx < ds->dstW; dx++) {
+      int      i = dy*THUMB_SIZE + dx;
+      int      o = (ds->offY+dy)*THUMB_SIZE + ds->offX+dx;
+      uint32_t n = ds->n[i], t = ds->total[i];
+      if(!ds->opaque)
+        pixels[o] = PIXEL(ds->allR[i]/t, ds->allG[i]/t, ds->allB[i]/t);
+      else if(n > 0 && n*2 >= t)
+        pixels[o] = PIXEL(ds->r[i]/n, ds->g[i]/n, ds->b[i]/n);
+    }
+  }
+}
+
+static uint32_t get16(const unsigned char *p) {
+  return p[0] | p[1] << 8;
+}
+
+static uint32_t get32(const unsigned char *p) {
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint32_t get32be(const unsigned char *p) {
+  return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+// Buffered sequential reader
+typedef struct {
+  void          *fp;
+  uint32_t      offset; // bytes consumed
+  int           pos, len;
+  unsigned char buf[THUMB_BUFSIZE];
+} reader_t;
+
+static int reader_fill(reader_t *r) {
+  ssize_t len = fs_read(r->fp, r->buf, sizeof(r->buf));
+  if(len <= 0)
+    return -1;
+  r->pos = 0;
+  r->len = len;
+  return 0;
+}
+
+static int reader_getc(reader_t *r) {
+  if(r->pos == r->len && reader_fill(r) != 0)
+    return -1;
+  r->offset++;
+  return r->buf[r->pos++];
+}
+
+// read len bytes, or skip them if buf is NULL
+static int reader_read(reader_t *r, void *buf, size_t len) {
+  unsigned char *p = buf;
+
+  while(len > 0) {
+    size_t n;
+    if(r->pos == r->len && reader_fill(r) != 0)
+      return -1;
+    n = (size_t)(r->len - r->pos) < len ? (size_t)(r->len - r->pos) : len;
+    if(p != NULL) {
+      memcpy(p, &r->buf[r->pos], n);
+      p += n;
+    }
+    r->pos    += n;
+    r->offset += n;
+    len       -= n;
+  }
+  return 0;
+}
+
+// Decoding
+//
+// A decode is a job which works through its image a row at a time, so it can
+// be spread over frames with thumbs_step(). Rows are at most THUMB_MAX_DIM
+// pixels, which bounds the work of one step. Reading back a thumbnail the
+// cache file holds is a job too.
+typedef enum {
+  JOB_BMP = 0,
+  JOB_PNG,
+  JOB_GRF,
+  JOB_CACHE,
+} job_kind_t;
+
+typedef enum {
+  STAGE_HEADER = 0,
+  STAGE_SKIP,   // discard skip bytes, then go to next
+  STAGE_CHUNK,  // GRF chunk header
+  STAGE_ROWS,
+  STAGE_DONE,
+} stage_t;
+
+// PNG inflate state, allocated with the window the zlib header asks for
+typedef struct {
+  short count[16];         // codes of each length
+  short symbol[288];       // in canonical order
+} huff_t;
+
+typedef enum {
+  BLOCK_NONE = 0,          // next is a block header
+  BLOCK_STORED,
+  BLOCK_CODES,
+} block_t;
+
+typedef struct {
+  uint32_t      bitBuf;
+  int           bitCount;
+  int           last;      // the block in progress is the final one
+  block_t       block;
+  uint32_t      stored;    // stored bytes left in the block
+  uint32_t      copyLen;   // back reference left to copy
+  uint32_t      dist;
+  uint32_t      outPos;
+  uint32_t      mask;      // window size - 1
+  huff_t        lens, dists;
+  unsigned char window[];
+} inflate_t;
+
+struct thumbjob {
+  int           index;     // thumbnail in the cache
+  job_kind_t    kind;
+  uint32_t      size;      // key of the file
+  uint32_t      mtime;
+  stage_t       stage;
+  stage_t       next;
+  uint32_t      skip;
+  reader_t      in;
+  downscale_t   *ds;
+  int32_t       w, h;
+  int32_t       y;
+  unsigned char *raw;      // one source row
+  uint32_t      *row;      // and converted
+
+  // BMP, and PNG for its palette
+  int           bpp;
+  int           topDown;
+  uint32_t      rowSize;
+  unsigned char pal[256*4]; // BGRx for BMP, RGBA for PNG
+
+  // PNG: 8-bit samples, deflate streamed across the IDAT chunks
+  int           colorType;
+  int           channels;
+  uint32_t      idatLeft;
+  inflate_t     *z;
+
+  // GRF: streamed GBA/DS BIOS decompression, none, LZ77 or RLE
+  uint32_t      type;
+  uint32_t      outSize;
+  uint32_t      outPos;
+  uint32_t      copyLen;   // LZ77 back reference left to copy
+  uint32_t      disp;
+  int           flags;
+  int           bits;
+  uint32_t      runLen;    // RLE run left
+  int           runByte;   // repeated byte, -1 for literals
+  unsigned char window[4096];
+};
+
+static void job_free(int id, thumbjob_t *j) {
+  if(j->in.fp != NULL)
+    fs_close(j->in.fp);
+  mb_free(id, j->row);
+  mb_free(id, j->raw);
+  mb_free(id, j->ds);
+  mb_free(id, j->z);
+  mb_free(id, j);
+}
+
+static thumbjob_t* job_open(int id, const char *path) {
+  const char *ext = strrchr(path, '.');
+  thumbjob_t *j;
+
+  if(ext == NULL || !thumb_is_image(path)) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  j = mb_malloc(id, sizeof(thumbjob_t));
+  if(j == NULL) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  memset(j, 0, sizeof(thumbjob_t));
+  j->kind = stricmp(ext, ".grf") == 0 ? JOB_GRF : stricmp(ext, ".png") == 0 ? JOB_PNG : JOB_BMP;
+
+  j->in.fp = fs_open(path, "rb");
+  if(j->in.fp == NULL) {
+    job_free(id, j);
+    return NULL;
+  }
+  return j;
+}
+
+// read back the pixels at offset in a cache file
+static thumbjob_t* job_open_cache(int id, const char *path, uint32_t offset) {
+  thumbjob_t *j = mb_malloc(id, sizeof(thumbjob_t));
+
+  if(j == NULL) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  memset(j, 0, sizeof(thumbjob_t));
+  j->kind  = JOB_CACHE;
+  j->skip  = offset;
+  j->next  = STAGE_ROWS;
+  j->stage = STAGE_SKIP;
+
+  j->raw   = mb_malloc(id, THUMB_PIXELS*sizeof(uint16_t));
+  j->in.fp = j->raw != NULL ? fs_open(path, "rb") : NULL;
+  if(j->in.fp == NULL) {
+    if(j->raw == NULL)
+      errno = ENOMEM;
+    job_free(id, j);
+    return NULL;
+  }
+  return j;
+}
+
+static int start_rows(int id, thumbjob_t *j, uint32_t rawLen) {
+  j->raw = mb_malloc(id, rawLen);
+  j->row = mb_malloc(id, j->w*sizeof(uint32_t));
+  j->ds  = mb_malloc(id, sizeof(downscale_t));
+  if(j->raw == NULL || j->row == NULL || j->ds == NULL)
+    return -1;
+  downscale_init(j->ds, j->w, j->h);
+  j->y = 0;
+  return 0;
+}
+
+// returns the work done, or -1 on failure
+static long skip_unit(thumbjob_t *j) {
+  uint32_t len = j->skip < THUMB_BUFSIZE ? j->skip : THUMB_BUFSIZE;
+
+  if(reader_read(&j->in, NULL, len) != 0)
+    return -1;
+  j->skip -= len;
+  if(j->skip == 0)
+    j->stage = j->next;
+  return len > 0 ? len : 1;
+}
+
+// BMP: uncompressed 1, 4, 8, 16, 24 and 32 bpp
+static long bmp_unit(int id, thumbjob_t *j) {
+  unsigned char hdr[54];
+  uint32_t      offset, infoSize, compression, colors;
+  int32_t       x;
+
+  switch(j->stage) {
+    case STAGE_HEADER:
+      if(reader_read(&j->in, hdr, sizeof(hdr)) != 0 || hdr[0] != 'B' || hdr[1] != 'M')
+        return -1;
+
+      offset      = get32(&hdr[10]);
+      infoSize    = get32(&hdr[14]);
+      j->w        = get32(&hdr[18]);
+      j->h        = get32(&hdr[22]);
+      j->bpp      = get16(&hdr[28]);
+      compression = get32(&hdr[30]);
+      colors      = get32(&hdr[46]);
+
+      j->topDown = j->h < 0;
+      if(j->topDown)
+        j->h = -j->h;
+      if(infoSize < 40 || infoSize - 40 > 1024 || compression != 0 || j->w <= 0 || j->h <= 0
+      || j->w > THUMB_MAX_DIM || j->h > THUMB_MAX_DIM)
+        return -1;
+      if(j->bpp != 1 && j->bpp != 4 && j->bpp != 8 && j->bpp != 16 && j->bpp != 24 && j->bpp != 32)
+        return -1;
+      if(colors == 0 || colors > 256)
+        colors = j->bpp <= 8 ? 1 << j->bpp : 0;
+      j->rowSize = ((j->w*j->bpp + 31)/32)*4;
+
+      // skip the rest of the info header, read the palette, skip to the pixels
+      if(reader_read(&j->in, NULL, infoSize - 40) != 0
+      || reader_read(&j->in, j->pal, colors*4) != 0
+      || start_rows(id, j, j->rowSize) != 0)
+        return -1;
+      j->skip  = offset > j->in.offset ? offset - j->in.offset : 0;
+      j->next  = STAGE_ROWS;
+      j->stage = j->skip > 0 ? STAGE_SKIP : STAGE_ROWS;
+      return j->in.offset;
+
+    case STAGE_SKIP:
+      return skip_unit(j);
+
+    case STAGE_ROWS:
+      if(reader_read(&j->in, j->raw, j->rowSize) != 0)
+        return -1;
+
+      for(x = 0; x < j->w; x++) {
+        const unsigned char *p;
+        uint32_t            v;
+        switch(j->bpp) {
+          case 32:
+          case 24:
+            p = &j->raw[x*(j->bpp/8)];
+            j->row[x] = OPAQUE | p[2] << 16 | p[1] << 8 | p[0];
+            break;
+          case 16:
+            v = get16(&j->raw[x*2]);
+            j->row[x] = OPAQUE | ((v >> 10) & 31) << 19 | ((v >> 5) & 31) << 11 | (v & 31) << 3;
+            break;
+          default:
+            v = (j->raw[x*j->bpp/8] >> (8 - j->bpp - (x*j->bpp)%8)) & ((1 << j->bpp) - 1);
+            p = &j->pal[v*4];
+            j->row[x] = OPAQUE | p[2] << 16 | p[1] << 8 | p[0];
+            break;
+        }
+      }
+
+      downscale_row(j->ds, j->topDown ? j->y : j->h-1-j->y, j->row);
+      if(++j->y == j->h)
+        j->stage = STAGE_DONE;
+      return j->rowSize;
+
+    default:
+      return -1;
+  }
+}
+
+// next byte of the zlib stream, which may be split over several IDAT chunks
+static int png_getc(thumbjob_t *j) {
+  unsigned char hdr[12];
+
+  while(j->idatLeft == 0) {
+    // CRC of the chunk just finished, then the next header
+    if(reader_read(&j->in, hdr, 12) != 0 || memcmp(&hdr[8], "IDAT", 4) != 0)
+      return -1;
+    j->idatLeft = get32be(&hdr[4]);
+  }
+  j->idatLeft--;
+  return reader_getc(&j->in);
+}
+
+static int z_bits(thumbjob_t *j, int n) {
+  inflate_t *z = j->z;
+  uint32_t  v;
+
+  while(z->bitCount < n) {
+    int c = png_getc(j);
+    if(c < 0)
+      return -1;
+    z->bitBuf   |= (uint32_t)c << z->bitCount;
+    z->bitCount += 8;
+  }
+  v = z->bitBuf & ((1u << n) - 1);
+  z->bitBuf   >>= n;
+  z->bitCount -= n;
+  return v;
+}
+
+// canonical Huffman codes, decoded a bit at a time
+static int huff_build(huff_t *h, const short *length, int n) {
+  short offs[16];
+  int   len, sym, left = 1;
+
+  memset(h->count, 0, sizeof(h->count));
+  for(sym = 0; sym < n; sym++)
+    h->count[length[sym]]++;
+  for(len = 1; len < 16; len++) {
+    left = (left << 1) - h->count[len];
+    if(left < 0)
+      return -1;
+  }
+
+  offs[1] = 0;
+  for(len = 1; len < 15; len++)
+    offs[len+1] = offs[len] + h->count[len];
+  for(sym = 0; sym < n; sym++) {
+    if(length[sym] != 0)
+      h->symbol[offs[length[sym]]++] = sym;
+  }
+  return 0;
+}
+
+static int huff_decode(thumbjob_t *j, const huff_t *h) {
+  int code = 0, first = 0, index = 0, len;
+
+  for(len = 1; len < 16; len++) {
+    int bit = z_bits(j, 1);
+    if(bit < 0)
+      return -1;
+    code |= bit;
+    if(code - h->count[len] < first)
+      return h->symbol[index + code - first];
+    index += h->count[len];
+    first  = (first + h->count[len]) << 1;
+    code <<= 1;
+  }
+  return -1;
+}
+
+static int z_fixed(inflate_t *z) {
+  short length[288];
+  int   i;
+
+  for(i = 0; i < 288; i++)
+    length[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+  if(huff_build(&z->lens, length, 288) != 0)
+    return -1;
+  for(i = 0; i < 30; i++)
+    length[i] = 5;
+  return huff_build(&z->dists, length, 30);
+}
+
+static int z_dynamic(thumbjob_t *j) {
+  static const unsigned char order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+  inflate_t *z = j->z;
+  short     length[288+32];
+  int       nlen, ndist, ncode, i, n;
+
+  nlen  = z_bits(j, 5);
+  ndist = z_bits(j, 5);
+  ncode = z_bits(j, 4);
+  if(nlen < 0 || ndist < 0 || ncode < 0)
+    return -1;
+  nlen  += 257;
+  ndist += 1;
+  ncode += 4;
+  if(nlen > 286 || ndist > 30)
+    return -1;
+
+  memset(length, 0, sizeof(length));
+  for(i = 0; i < ncode; i++) {
+    int v = z_bits(j, 3);
+    if(v < 0)
+      return -1;
+    length[order[i]] = v;
+  }
+  if(huff_build(&z->lens, length, 19) != 0)
+    return -1;
+
+  for(i = 0; i < nlen + ndist; ) {
+    int sym = huff_decode(j, &z->lens), v = 0;
+    if(sym < 0)
+      return -1;
+    if(sym < 16) {
+      length[i++] = sym;
+      continue;
+    }
+    if(sym == 16) {
+      if(i == 0)
+        return -1;
+      v = length[i-1];
+      n = z_bits(j, 2);
+    }
+    else
+      n = z_bits(j, sym == 17 ? 3 : 7);
+    if(n < 0)
+      return -1;
+    n += sym == 18 ? 11 : 3;
+    if(i + n > nlen + ndist)
+      return -1;
+    while(n-- > 0)
+      length[i++] = v;
+  }
+
+  if(length[256] == 0 || huff_build(&z->lens, length, nlen) != 0)
+    return -1;
+  return huff_build(&z->dists, length + nlen, ndist);
+}
+
+// produce the next len bytes of the inflated stream
+static int z_output(thumbjob_t *j, unsigned char *out, uint32_t len) {
+  static const short lenBase[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+  static const unsigned char lenExtra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+  static const unsigned short distBase[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+  static const unsigned char distExtra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+  inflate_t *z = j->z;
+
+  while(len > 0) {
+    int c;
+
+    if(z->copyLen > 0) {
+      c = z->window[(z->outPos - z->dist) & z->mask];
+      z->copyLen--;
+    }
+    else if(z->block == BLOCK_STORED && z->stored > 0) {
+      c = png_getc(j);
+      z->stored--;
+    }
+    else if(z->block == BLOCK_CODES) {
+      int sym = huff_decode(j, &z->lens), extra;
+      if(sym < 0)
+        return -1;
+      if(sym == 256) {
+        z->block = BLOCK_NONE;
+        continue;
+      }
+      if(sym < 256)
+        c = sym;
+      else {
+        sym -= 257;
+        if(sym >= 29 || (extra = z_bits(j, lenExtra[sym])) < 0)
+          return -1;
+        z->copyLen = lenBase[sym] + extra;
+        sym = huff_decode(j, &z->dists);
+        if(sym < 0 || sym >= 30 || (extra = z_bits(j, distExtra[sym])) < 0)
+          return -1;
+        z->dist = distBase[sym] + extra;
+        if(z->dist > z->outPos || z->dist > z->mask + 1)
+          return -1;
+        continue;
+      }
+    }
+    else {
+      int type;
+
+      // the stream ended before the image did
+      if(z->last)
+        return -1;
+      z->last = z_bits(j, 1);
+      type    = z_bits(j, 2);
+      if(type == 0) {
+        int lo, hi;
+        z->bitBuf   = 0;
+        z->bitCount = 0;
+        lo = z_bits(j, 16);
+        hi = z_bits(j, 16);
+        if(lo < 0 || hi < 0 || lo != (~hi & 0xFFFF))
+          return -1;
+        z->stored = lo;
+        z->block  = BLOCK_STORED;
+      }
+      else if(type == 1 && z_fixed(z) == 0)
+        z->block = BLOCK_CODES;
+      else if(type == 2 && z_dynamic(j) == 0)
+        z->block = BLOCK_CODES;
+      else
+        return -1;
+      continue;
+    }
+
+    if(c < 0)
+      return -1;
+    z->window[z->outPos & z->mask] = c;
+    z->outPos++;
+    *out++ = c;
+    len--;
+  }
+  return 0;
+}
+
+static int paeth(int a, int b, int c) {
+  int pa = abs(b - c), pb = abs(a - c), pc = abs(a + b - 2*c);
+  return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+}
+
+// PNG: 8-bit greyscale, truecolour and palette images, with or without
+// alpha, not interlaced. raw holds the previous row and then the current one
+static long png_unit(int id, thumbjob_t *j) {
+  static const unsigned char channels[7] = { 1, 0, 3, 1, 2, 0, 4 };
+  unsigned char hdr[33];
+  unsigned char *prev, *cur;
+  uint32_t      size, i;
+  int           cmf, flg, filter, bpp;
+  int32_t       x;
+
+  switch(j->stage) {
+    case STAGE_HEADER:
+      // signature and IHDR, which has to come first
+      if(reader_read(&j->in, hdr, 33) != 0 || memcmp(hdr, "\x89PNG\r\n\x1a\n", 8) != 0
+      || get32be(&hdr[8]) != 13 || memcmp(&hdr[12], "IHDR", 4) != 0)
+        return -1;
+      j->w         = get32be(&hdr[16]);
+      j->h         = get32be(&hdr[20]);
+      j->colorType = hdr[25];
+      if(hdr[24] != 8 || j->colorType > 6 || channels[j->colorType] == 0
+      || hdr[26] != 0 || hdr[27] != 0 || hdr[28] != 0
+      || j->w <= 0 || j->h <= 0 || j->w > THUMB_MAX_DIM || j->h > THUMB_MAX_DIM)
+        return -1;
+      j->channels = channels[j->colorType];
+      j->rowSize  = j->w*j->channels;
+      for(i = 0; i < 256; i++)
+        j->pal[i*4+3] = 0xFF;
+      j->stage = STAGE_CHUNK;
+      return 33;
+
+    case STAGE_CHUNK:
+      if(reader_read(&j->in, hdr, 8) != 0)
+        return -1;
+      size = get32be(hdr);
+
+      if(memcmp(&hdr[4], "PLTE", 4) == 0 && size % 3 == 0 && size <= 256*3) {
+        for(i = 0; i < size/3; i++) {
+          if(reader_read(&j->in, &j->pal[i*4], 3) != 0)
+            return -1;
+        }
+        j->skip = 4;
+      }
+      else if(memcmp(&hdr[4], "tRNS", 4) == 0 && j->colorType == 3 && size <= 256) {
+        for(i = 0; i < size; i++) {
+          if(reader_read(&j->in, &j->pal[i*4+3], 1) != 0)
+            return -1;
+        }
+        j->skip = 4;
+      }
+      else if(memcmp(&hdr[4], "IDAT", 4) == 0) {
+        j->idatLeft = size;
+
+        // zlib header: deflate, no preset dictionary
+        cmf = png_getc(j);
+        flg = png_getc(j);
+        if(cmf < 0 || flg < 0 || (cmf & 0x0F) != 8 || (cmf >> 4) > 7
+        || (cmf << 8 | flg) % 31 != 0 || (flg & 0x20))
+          return -1;
+        size = 1 << ((cmf >> 4) + 8);
+        j->z = mb_malloc(id, sizeof(inflate_t) + size);
+        if(j->z == NULL || start_rows(id, j, j->rowSize*2) != 0)
+          return -1;
+        memset(j->z, 0, sizeof(inflate_t));
+        j->z->mask = size - 1;
+        memset(j->raw, 0, j->rowSize);
+        j->stage = STAGE_ROWS;
+        return 10;
+      }
+      else if(memcmp(&hdr[4], "IEND", 4) == 0)
+        return -1;
+      else
+        j->skip = size + 4;
+
+      j->next  = STAGE_CHUNK;
+      j->stage = STAGE_SKIP;
+      return 8;
+
+    case STAGE_SKIP:
+      return skip_unit(j);
+
+    case STAGE_ROWS:
+      prev = j->raw;
+      cur  = j->raw + j->rowSize;
+      bpp  = j->channels;
+      if(z_output(j, hdr, 1) != 0 || hdr[0] > 4 || z_output(j, cur, j->rowSize) != 0)
+        return -1;
+
+      filter = hdr[0];
+      for(i = 0; i < j->rowSize; i++) {
+        int a = i >= (uint32_t)bpp ? cur[i-bpp] : 0;
+        int c = i >= (uint32_t)bpp ? prev[i-bpp] : 0;
+        switch(filter) {
+          case 1: cur[i] += a;                       break;
+          case 2: cur[i] += prev[i];                 break;
+          case 3: cur[i] += (a + prev[i]) >> 1;      break;
+          case 4: cur[i] += paeth(a, prev[i], c);    break;
+        }
+      }
+
+      for(x = 0; x < j->w; x++) {
+        const unsigned char *p = &cur[x*bpp];
+        switch(j->colorType) {
+          case 0: j->row[x] = OPAQUE | p[0] << 16 | p[0] << 8 | p[0];                          break;
+          case 2: j->row[x] = OPAQUE | p[0] << 16 | p[1] << 8 | p[2];                          break;
+          case 4: j->row[x] = (p[1] & 0x80 ? OPAQUE : 0) | p[0] << 16 | p[0] << 8 | p[0];      break;
+          case 6: j->row[x] = (p[3] & 0x80 ? OPAQUE : 0) | p[0] << 16 | p[1] << 8 | p[2];      break;
+          default:
+            p = &j->pal[p[0]*4];
+            j->row[x] = (p[3] & 0x80 ? OPAQUE : 0) | p[0] << 16 | p[1] << 8 | p[2];
+            break;
+        }
+      }
+      memcpy(prev, cur, j->rowSize);
+
+      downscale_row(j->ds, j->y, j->row);
+      if(++j->y == j->h)
+        j->stage = STAGE_DONE;
+      return j->rowSize + 1;
+
+    default:
+      return -1;
+  }
+}
+
+// produce the next len bytes of decompressed GRF graphics
+static int grf_output(thumbjob_t *j, unsigned char *out, uint32_t len) {
+  while(len > 0) {
+    int c;
+
+    if(j->outPos >= j->outSize)
+      return -1;
+
+    if(j->type == 0x00)
+      c = reader_getc(&j->in);
+    else if(j->type == 0x10) {
+      if(j->copyLen > 0) {
+        c = j->window[(j->outPos - j->disp) & 0xFFF];
+        j->copyLen--;
+      }
+      else {
+        if(j->bits == 0) {
+          j->flags = reader_getc(&j->in);
+          j->bits  = 8;
+          if(j->flags < 0)
+            return -1;
+        }
+        j->bits--;
+        if(j->flags & (1 << j->bits)) {
+          int hi = reader_getc(&j->in);
+          int lo = reader_getc(&j->in);
+          if(hi < 0 || lo < 0)
+            return -1;
+          j->copyLen = (hi >> 4) + 3;
+          j->disp    = ((hi & 0xF) << 8 | lo) + 1;
+          if(j->disp > j->outPos)
+            return -1;
+          continue;
+        }
+        c = reader_getc(&j->in);
+      }
+    }
+    else {
+      if(j->runLen == 0) {
+        int flag = reader_getc(&j->in);
+        if(flag < 0)
+          return -1;
+        if(flag & 0x80) {
+          j->runLen  = (flag & 0x7F) + 3;
+          j->runByte = reader_getc(&j->in);
+          if(j->runByte < 0)
+            return -1;
+        }
+        else {
+          j->runLen  = flag + 1;
+          j->runByte = -1;
+        }
+      }
+      c = j->runByte >= 0 ? j->runByte : reader_getc(&j->in);
+      j->runLen--;
+    }
+
+    if(c < 0)
+      return -1;
+    j->window[j->outPos & 0xFFF] = c;
+    j->outPos++;
+    *out++ = c;
+    len--;
+  }
+  return 0;
+}
+
+// GRF: 16-bit bitmaps as produced by grit -gb -gB16, optionally compressed.
+// grit writes the HDR chunk before the GFX chunk, which is relied on here
+static long grf_unit(int id, thumbjob_t *j) {
+  unsigned char hdr[16];
+  uint32_t      size, x;
+
+  switch(j->stage) {
+    case STAGE_HEADER:
+      if(reader_read(&j->in, hdr, 12) != 0 || memcmp(hdr, "RIFF", 4) != 0 || memcmp(&hdr[8], "GRF ", 4) != 0)
+        return -1;
+      j->stage = STAGE_CHUNK;
+      return 12;
+
+    case STAGE_CHUNK:
+      if(reader_read(&j->in, hdr, 8) != 0)
+        return -1;
+      size = get32(&hdr[4]);
+
+      if(memcmp(hdr, "HDR ", 4) == 0 && size >= 16) {
+        if(reader_read(&j->in, hdr, 16) != 0)
+          return -1;
+        j->bpp = hdr[0];
+        j->w   = get32(&hdr[8]);
+        j->h   = get32(&hdr[12]);
+        j->skip = size - 16 + (size & 1);
+      }
+      else if(memcmp(hdr, "GFX ", 4) == 0) {
+        if(j->bpp != 16 || j->w <= 0 || j->h <= 0 || j->w > THUMB_MAX_DIM || j->h > THUMB_MAX_DIM
+        || reader_read(&j->in, hdr, 4) != 0)
+          return -1;
+        j->type    = hdr[0] & 0xF0;
+        j->outSize = get32(hdr) >> 8;
+        if((j->type != 0x00 && j->type != 0x10 && j->type != 0x30)
+        || j->outSize < (uint32_t)j->w*j->h*2 || start_rows(id, j, j->w*2) != 0)
+          return -1;
+        j->stage = STAGE_ROWS;
+        return 12;
+      }
+      else
+        j->skip = size + (size & 1);
+
+      j->next  = STAGE_CHUNK;
+      j->stage = j->skip > 0 ? STAGE_SKIP : STAGE_CHUNK;
+      return 8;
+
+    case STAGE_SKIP:
+      return skip_unit(j);
+
+    case STAGE_ROWS:
+      if(grf_output(j, j->raw, j->w*2) != 0)
+        return -1;
+
+      // images converted without transparency have no alpha bits at all,
+      // which the box filter takes care of
+      for(x = 0; x < (uint32_t)j->w; x++) {
+        uint32_t v = get16(&j->raw[x*2]);
+        j->row[x] = (v & 0x8000 ? OPAQUE : 0)
+                  | (v & 31) << 19 | ((v >> 5) & 31) << 11 | ((v >> 10) & 31) << 3;
+      }
+      downscale_row(j->ds, j->y, j->row);
+      if(++j->y == j->h)
+        j->stage = STAGE_DONE;
+      return j->w*2;
+
+    default:
+      return -1;
+  }
+}
+
+static long cache_unit(thumbjob_t *j) {
+  switch(j->stage) {
+    case STAGE_SKIP:
+      return skip_unit(j);
+
+    case STAGE_ROWS:
+      if(reader_read(&j->in, j->raw, THUMB_PIXELS*sizeof(uint16_t)) != 0)
+        return -1;
+      j->stage = STAGE_DONE;
+      return THUMB_PIXELS*sizeof(uint16_t);
+
+    default:
+      return -1;
+  }
+}
+
+// work on a job for about budget bytes. returns 1 once the image is
+// decoded, 0 if there is more to do and -1 on failure
+static int job_step(int id, thumbjob_t *j, size_t *budget) {
+  while(*budget > 0 && j->stage != STAGE_DONE) {
+    long work;
+    if(j->kind == JOB_BMP)
+      work = bmp_unit(id, j);
+    else if(j->kind == JOB_PNG)
+      work = png_unit(id, j);
+    else if(j->kind == JOB_GRF)
+      work = grf_unit(id, j);
+    else
+      work = cache_unit(j);
+    if(work < 0)
+      return -1;
+    *budget = spend(*budget, work);
+  }
+  return j->stage == STAGE_DONE ? 1 : 0;
+}
+
+int thumb_decode(const char *path, uint16_t *pixels) {
+  thumbjob_t *j = job_open(client, path);
+  size_t     budget = (size_t)-1;
+  int        rc;
+
+  if(j == NULL)
+    return -1;
+  rc = job_step(client, j, &budget);
+  if(rc > 0)
+    downscale_finish(j->ds, pixels);
+  job_free(client, j);
+  return rc > 0 ? 0 : -1;
+}
+
+// Cache
+//
+// One file per folder holding "XBT1", the entry count, then for each entry
+// its size, mtime, a decoded flag, the name length and name, and the pixels
+// when decoded. It is read front to back in one pass when a folder is opened.
+// Thumbnails dropped for memory keep their place in it, and are read back
+// from there when they are needed again.
+#define RECORD_SIZE 10
+
+static size_t close_reader(thumbcache_t *tc) {
+  if(tc->reader == NULL)
+    return 0;
+  job_free(tc->client, tc->reader);
+  tc->reader = NULL;
+  return sizeof(thumbjob_t) + THUMB_PIXELS*sizeof(uint16_t);
+}
+
+// thumbnails which are in the cache file go first, then the open cache file,
+// and only then thumbnails which would need decoding again
+static size_t evict_thumbs(void *ctx, size_t want) {
+  thumbcache_t *tc = ctx;
+  size_t       freed = 0;
+  int          i, pass;
+
+  for(pass = 0; pass < 2 && freed < want; pass++) {
+    if(pass == 1)
+      freed += close_reader(tc);
+    for(i = 0; i < tc->count && freed < want; i++) {
+      thumb_t *t = &tc->thumbs[i];
+      if(t->pixels != NULL && (t->stored != 0 || pass == 1)
+      && (tc->job == NULL || i != tc->job->index) && (i < tc->first || i >= tc->last)) {
+        mb_free(tc->client, t->pixels);
+        t->pixels = NULL;
+        if(t->state == THUMB_PENDING)
+          tc->pending--;
+        t->state = THUMB_EVICTED;
+        freed += THUMB_PIXELS*sizeof(uint16_t);
+      }
+    }
+  }
+  return freed;
+}
+
+// pixels are only loaded while they fit without pushing anything else out
+static void load_cache(thumbcache_t *tc) {
+  reader_t      *r;
+  unsigned char hdr[RECORD_SIZE];
+  uint32_t      count, n;
+  int           j = 0;
+
+  r = mb_malloc(tc->client, sizeof(reader_t));
+  if(r == NULL)
+    return;
+  memset(r, 0, sizeof(reader_t));
+
+  r->fp = fs_open(tc->path, "rb");
+  if(r->fp == NULL || reader_read(r, hdr, 8) != 0 || memcmp(hdr, THUMB_MAGIC, 4) != 0)
+    goto out;
+
+  count = get32(&hdr[4]);
+  for(n = 0; n < count; n++) {
+    thumb_t  *t = NULL;
+    uint32_t size, mtime;
+    int      ok, len, k;
+    char     name[256];
+
+    if(reader_read(r, hdr, RECORD_SIZE) != 0)
+      break;
+    size  = get32(&hdr[0]);
+    mtime = get32(&hdr[4]);
+    ok    = hdr[8];
+    len   = hdr[9];
+    if(reader_read(r, name, len) != 0)
+      break;
+    name[len] = 0;
+
+    // entries were saved in listing order, so search on from the last match
+    for(k = 0; k < tc->count; k++, j = (j+1) % tc->count) {
+      if(tc->thumbs[j].state == THUMB_PENDING && !tc->thumbs[j].keyed
+      && strcmp(tc->thumbs[j].name, name) == 0) {
+        t = &tc->thumbs[j];
+        j = (j+1) % tc->count;
+        break;
+      }
+    }
+
+    if(t != NULL) {
+      t->size   = size;
+      t->mtime  = mtime;
+      t->keyed  = 1;
+      t->failed = !ok;
+      t->stored = ok ? r->offset : 0;
+      if(ok && mb_used() + THUMB_PIXELS*sizeof(uint16_t) <= mb_limit())
+        t->pixels = mb_malloc(tc->client, THUMB_PIXELS*sizeof(uint16_t));
+    }
+    if(ok && reader_read(r, t != NULL ? t->pixels : NULL, THUMB_PIXELS*sizeof(uint16_t)) != 0) {
+      // truncated, so the last thumbnail isn't there after all
+      if(t != NULL) {
+        mb_free(tc->client, t->pixels);
+        t->pixels = NULL;
+        t->keyed  = 0;
+        t->stored = 0;
+      }
+      break;
+    }
+  }
+
+out:
+  if(r->fp != NULL)
+    fs_close(r->fp);
+  mb_free(tc->client, r);
+}
+
+thumbcache_t* thumbs_open(struct dirent **list, int count) {
+  thumbcache_t *tc = calloc(1, sizeof(thumbcache_t));
+  char         cwd[FILENAME_MAX];
+  int          i;
+
+  if(tc == NULL)
+    return NULL;
+
+  if(fs_getcwd(cwd, sizeof(cwd)) == NULL
+  || snprintf(tc->path, sizeof(tc->path), "%s%s" THUMB_FILE, cwd,
+              cwd[0] && cwd[strlen(cwd)-1] == '/' ? "" : "/") >= (int)sizeof(tc->path)) {
+    free(tc);
+    return NULL;
+  }
+
+  tc->client  = mb_register("thumbs", evict_thumbs, tc);
+  client = tc->client;
+  tc->count  = count > 0 ? count : 0;
+  tc->thumbs = mb_malloc(tc->client, tc->count*sizeof(thumb_t) + 1);
+  if(tc->thumbs == NULL) {
+    mb_unregister(tc->client);
+    free(tc);
+    return NULL;
+  }
+  memset(tc->thumbs, 0, tc->count*sizeof(thumb_t));
+
+  for(i = 0; i < tc->count; i++) {
+    if(list[i]->d_type != DT_DIR && thumb_is_image(list[i]->d_name)) {
+      tc->thumbs[i].name = mb_strdup(tc->client, list[i]->d_name);
+      if(tc->thumbs[i].name != NULL) {
+        tc->thumbs[i].state = THUMB_PENDING;
+        tc->pending++;
+      }
+    }
+  }
+
+  load_cache(tc);
+  return tc;
+}
+
+static void finish(thumbcache_t *tc, thumb_t *t, thumb_state_t state) {
+  if(t->state == THUMB_PENDING)
+    tc->pending--;
+  t->state = state;
+}
+
+static void forget(thumbcache_t *tc, thumb_t *t) {
+  mb_free(tc->client, t->pixels);
+  t->pixels = NULL;
+  t->keyed  = 0;
+  t->failed = 0;
+  t->stored = 0;
+}
+
+// check the key of a thumbnail, and start reading it back or decoding it if
+// that is needed. returns its index if it changed already
+static int start(thumbcache_t *tc, int i, size_t *budget) {
+  thumb_t     *t = &tc->thumbs[i];
+  struct stat statbuf;
+
+  *budget = spend(*budget, THUMB_CHECK_COST);
+
+  if(fs_stat(t->name, &statbuf) != 0) {
+    forget(tc, t);
+    tc->dirty = 1;
+    finish(tc, t, THUMB_FAILED);
+    return i;
+  }
+
+  // the cache file is still right
+  if(t->keyed && t->size == (uint32_t)statbuf.st_size && t->mtime == (uint32_t)statbuf.st_mtime) {
+    if(t->pixels != NULL || t->failed) {
+      finish(tc, t, t->pixels != NULL ? THUMB_READY : THUMB_FAILED);
+      return i;
+    }
+    if(t->stored != 0) {
+      // carry on from the last read back when it is further up the file
+      if(tc->reader != NULL && tc->reader->in.offset <= t->stored) {
+        tc->job        = tc->reader;
+        tc->reader     = NULL;
+        tc->job->skip  = t->stored - tc->job->in.offset;
+        tc->job->stage = STAGE_SKIP;
+      }
+      else {
+        close_reader(tc);
+        tc->job = job_open_cache(tc->client, tc->path, t->stored);
+      }
+      if(tc->job != NULL) {
+        tc->job->index = i;
+        return -1;
+      }
+      if(errno == ENOMEM)
+        goto nomem;
+    }
+  }
+  else if(t->keyed) {
+    forget(tc, t);
+    tc->dirty = 1;
+  }
+
+  tc->job = job_open(tc->client, t->name);
+  if(tc->job == NULL) {
+    if(errno == ENOMEM)
+      goto nomem;
+    forget(tc, t);
+    t->size   = statbuf.st_size;
+    t->mtime  = statbuf.st_mtime;
+    t->keyed  = 1;
+    t->failed = 1;
+    tc->dirty = 1;
+    finish(tc, t, THUMB_FAILED);
+    return i;
+  }
+
+  tc->job->index = i;
+  tc->job->size  = statbuf.st_size;
+  tc->job->mtime = statbuf.st_mtime;
+  return -1;
+
+nomem:
+  // no room, show the generic icon until it is visible again
+  finish(tc, t, THUMB_EVICTED);
+  *budget = 0;
+  return -1;
+}
+
+static void abort_job(thumbcache_t *tc) {
+  job_free(tc->client, tc->job);
+  tc->job = NULL;
+}
+
+// work on the job some more, returns the index of its thumbnail once done
+static int run(thumbcache_t *tc, size_t *budget) {
+  thumbjob_t *j = tc->job;
+  thumb_t    *t = &tc->thumbs[j->index];
+  uint16_t   pixels[THUMB_PIXELS];
+  int        i = j->index;
+  int        rc = job_step(tc->client, j, budget);
+
+  if(rc == 0)
+    return -1;
+
+  // the job's buffers go before the pixels are allocated
+  if(rc > 0 && j->kind == JOB_CACHE)
+    memcpy(pixels, j->raw, sizeof(pixels));
+  else if(rc > 0)
+    downscale_finish(j->ds, pixels);
+
+  if(j->kind == JOB_CACHE && rc > 0) {
+    // keep the file open, the next one is likely further down
+    tc->reader = j;
+    tc->job    = NULL;
+  }
+  else if(j->kind == JOB_CACHE) {
+    // the cache file changed under us, decode it instead
+    abort_job(tc);
+    forget(tc, t);
+    tc->dirty = 1;
+    return -1;
+  }
+  else {
+    forget(tc, t);
+    t->size   = j->size;
+    t->mtime  = j->mtime;
+    t->keyed  = 1;
+    t->failed = rc < 0;
+    tc->dirty = 1;
+    abort_job(tc);
+    if(rc < 0) {
+      finish(tc, t, THUMB_FAILED);
+      return i;
+    }
+  }
+
+  if(t->pixels == NULL)
+    t->pixels = mb_malloc(tc->client, THUMB_PIXELS*sizeof(uint16_t));
+  if(t->pixels == NULL) {
+    finish(tc, t, THUMB_EVICTED);
+    return i;
+  }
+  memcpy(t->pixels, pixels, sizeof(pixels));
+  finish(tc, t, THUMB_READY);
+  return i;
+}
+
+int thumbs_step(thumbcache_t *tc, int first, int last, size_t *budget) {
+  int i, n, visible;
+
+  tc->first = first;
+  tc->last  = last;
+  mb_touch(tc->client);
+
+  while(*budget > 0) {
+    // visible rows first
+    visible = -1;
+    for(i = first; visible < 0 && i < last && i < tc->count; i++) {
+      if(tc->thumbs[i].state == THUMB_PENDING || tc->thumbs[i].state == THUMB_EVICTED)
+        visible = i;
+    }
+
+    if(tc->job != NULL) {
+      // a background job gives way to rows scrolled into view, though a
+      // read back keeps its place in the cache file
+      if(visible >= 0 && (tc->job->index < first || tc->job->index >= last)) {
+        if(tc->job->kind == JOB_CACHE) {
+          close_reader(tc);
+          tc->reader = tc->job;
+          tc->job    = NULL;
+        }
+        else
+          abort_job(tc);
+        continue;
+      }
+      i = run(tc, budget);
+      if(i >= 0)
+        return i;
+      continue;
+    }
+
+    // then the rest of the folder in the background
+    i = visible;
+    for(n = 0; i < 0 && tc->pending > 0 && n < tc->count; n++) {
+      tc->cursor = (tc->cursor + 1) % tc->count;
+      if(tc->thumbs[tc->cursor].state == THUMB_PENDING)
+        i = tc->cursor;
+    }
+    if(i < 0)
+      return -1;
+
+    i = start(tc, i, budget);
+    if(i >= 0)
+      return i;
+  }
+
+  return -1;
+}
+
+const uint16_t* thumbs_get(thumbcache_t *tc, int i) {
+  if(i < 0 || i >= tc->count || tc->thumbs[i].state != THUMB_READY)
+    return NULL;
+  return tc->thumbs[i].pixels;
+}
+
+void thumbs_remove(thumbcache_t *tc, int i) {
+  thumb_t *t = &tc->thumbs[i];
+
+  if(tc->job != NULL && tc->job->index == i)
+    abort_job(tc);
+  else if(tc->job != NULL && tc->job->index > i)
+    tc->job->index--;
+  if(t->state == THUMB_PENDING)
+    tc->pending--;
+  mb_free(tc->client, t->pixels);
+  mb_free(tc->client, t->name);
+  memmove(t, t+1, (tc->count-i-1)*sizeof(thumb_t));
+  tc->count--;
+  if(tc->cursor >= tc->count)
+    tc->cursor = 0;
+  tc->dirty = 1;
+}
+
+// Saving streams the new file out next to the old one, copying thumbnails
+// which are only on disk across, then swaps them
+typedef struct {
+  reader_t      old;
+  void          *fp;
+  size_t        len;
+  unsigned char buf[THUMB_BUFSIZE];
+} saver_t;
+
+static int save_put(saver_t *sv, const void *data, size_t len) {
+  const unsigned char *p = data;
+
+  while(len > 0) {
+    size_t n = sizeof(sv->buf) - sv->len < len ? sizeof(sv->buf) - sv->len : len;
+    memcpy(&sv->buf[sv->len], p, n);
+    sv->len += n;
+    p       += n;
+    len     -= n;
+    if(sv->len == sizeof(sv->buf)) {
+      if(fs_write(sv->fp, sv->buf, sv->len) != (ssize_t)sv->len)
+        return -1;
+      sv->len = 0;
+    }
+  }
+  return 0;
+}
+
+static int save_put32(saver_t *sv, uint32_t v) {
+  unsigned char p[4] = { v, v >> 8, v >> 16, v >> 24 };
+  return save_put(sv, p, 4);
+}
+
+static int save_stored(thumbcache_t *tc, saver_t *sv, uint32_t offset) {
+  uint16_t pixels[THUMB_PIXELS];
+
+  // entries are mostly in file order, so this rarely starts over
+  if(sv->old.fp == NULL || offset < sv->old.offset) {
+    if(sv->old.fp != NULL)
+      fs_close(sv->old.fp);
+    memset(&sv->old, 0, sizeof(reader_t));
+    sv->old.fp = fs_open(tc->path, "rb");
+    if(sv->old.fp == NULL)
+      return -1;
+  }
+
+  if(reader_read(&sv->old, NULL, offset - sv->old.offset) != 0
+  || reader_read(&sv->old, pixels, sizeof(pixels)) != 0)
+    return -1;
+  return save_put(sv, pixels, sizeof(pixels));
+}
+
+static int saved(const thumb_t *t) {
+  return t->keyed && strlen(t->name) < 256 && (t->pixels != NULL || t->failed || t->stored != 0);
+}
+
+int thumbs_save(thumbcache_t *tc) {
+  char     temp[FILENAME_MAX];
+  saver_t  *sv;
+  uint32_t count = 0, offset;
+  int      i, rc = 0;
+
+  if(!tc->dirty)
+    return 0;
+  if(snprintf(temp, sizeof(temp), "%s.new", tc->path) >= (int)sizeof(temp)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+
+  // offsets into the old file are about to change
+  if(tc->job != NULL && tc->job->kind == JOB_CACHE)
+    abort_job(tc);
+  close_reader(tc);
+
+  sv = mb_malloc(tc->client, sizeof(saver_t));
+  if(sv == NULL)
+    return -1;
+  memset(sv, 0, sizeof(saver_t));
+
+  for(i = 0; i < tc->count; i++) {
+    if(saved(&tc->thumbs[i]))
+      count++;
+  }
+
+  sv->fp = fs_open(temp, "wb");
+  if(sv->fp == NULL) {
+    mb_free(tc->client, sv);
+    return -1;
+  }
+
+  rc = save_put(sv, THUMB_MAGIC, 4) | save_put32(sv, count);
+  for(i = 0; rc == 0 && i < tc->count; i++) {
+    thumb_t       *t = &tc->thumbs[i];
+    unsigned char flags[2];
+
+    if(!saved(t))
+      continue;
+    flags[0] = t->pixels != NULL || t->stored != 0;
+    flags[1] = strlen(t->name);
+    rc = save_put32(sv, t->size) | save_put32(sv, t->mtime) | save_put(sv, flags, 2)
+       | save_put(sv, t->name, flags[1]);
+    if(rc == 0 && t->pixels != NULL)
+      rc = save_put(sv, t->pixels, THUMB_PIXELS*sizeof(uint16_t));
+    else if(rc == 0 && t->stored != 0)
+      rc = save_stored(tc, sv, t->stored);
+  }
+
+  if(rc == 0 && sv->len > 0 && fs_write(sv->fp, sv->buf, sv->len) != (ssize_t)sv->len)
+    rc = -1;
+  if(fs_close(sv->fp) != 0)
+    rc = -1;
+  if(sv->old.fp != NULL)
+    fs_close(sv->old.fp);
+  mb_free(tc->client, sv);
+
+  if(rc != 0) {
+    fs_remove(temp);
+    return -1;
+  }
+  fs_remove(tc->path);
+  if(fs_rename(temp, tc->path) != 0) {
+    // without a cache file nothing is stored any more
+    for(i = 0; i < tc->count; i++)
+      tc->thumbs[i].stored = 0;
+    return -1;
+  }
+
+  // thumbnails now sit where they were just written
+  offset = 8;
+  for(i = 0; i < tc->count; i++) {
+    thumb_t *t = &tc->thumbs[i];
+    if(!saved(t))
+      continue;
+    offset += RECORD_SIZE + strlen(t->name);
+    if(t->pixels != NULL || t->stored != 0) {
+      t->stored = offset;
+      offset += THUMB_PIXELS*sizeof(uint16_t);
+    }
+  }
+
+  tc->dirty = 0;
+  return 0;
+}
+
+void thumbs_close(thumbcache_t *tc) {
+  int i;
+
+  if(tc->job != NULL)
+    abort_job(tc);
+  close_reader(tc);
+  for(i = 0; i < tc->count; i++) {
+    mb_free(tc->client, tc->thumbs[i].pixels);
+    mb_free(tc->client, tc->thumbs[i].name);
+  }
+  mb_free(tc->client, tc->thumbs);
+  mb_unregister(tc->client);
+  free(tc);
+}
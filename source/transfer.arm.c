@@ -0,0 +1,566 @@
+#include <stdio.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "fs.h"
+#include "membudget.h"
+#include "scandir.h"
+#include "transfer.h"
+
+#define TRANSFER_BUFSIZE (32*1024)
+#define JOURNAL_MAGIC    "exb0rker journal 1"
+#define JOURNAL_COPIED   "copied\n"
+
+// the plan can't be evicted, so a big transfer may go over the budget
+static int client = -1;
+
+// join dir and name, name may be empty
+static int path_join(char *buf, size_t size, const char *dir, const char *name) {
+  size_t len = strlen(dir);
+  int    rc;
+
+  if(*name == 0)
+    rc = snprintf(buf, size, "%s", dir);
+  else if(len > 0 && dir[len-1] == '/')
+    rc = snprintf(buf, size, "%s%s", dir, name);
+  else if(len > 0)
+    rc = snprintf(buf, size, "%s/%s", dir, name);
+  else
+    rc = snprintf(buf, size, "%s", name);
+
+  if(rc < 0 || (size_t)rc >= size) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  return 0;
+}
+
+static int transfer_filter(const struct dirent *dent) {
+  return strcmp(dent->d_name, ".") != 0 && strcmp(dent->d_name, "..") != 0;
+}
+
+static void fail(transfer_t *t, int error) {
+  if(t->in != NULL)
+    fs_close(t->in);
+  if(t->out != NULL)
+    fs_close(t->out);
+  t->in    = NULL;
+  t->out   = NULL;
+  t->phase = TRANSFER_ERROR;
+  t->error = error;
+}
+
+static int add_item(transfer_t *t, const char *path, uint64_t size, int isDir) {
+  if(t->numItems == t->capItems) {
+    int             cap = t->capItems ? t->capItems*2 : 16;
+    transfer_item_t *temp = mb_realloc(client, t->items, cap*sizeof(transfer_item_t));
+    if(temp == NULL) {
+      errno = ENOMEM;
+      return -1;
+    }
+    t->items    = temp;
+    t->capItems = cap;
+  }
+
+  t->items[t->numItems].path = mb_strdup(client, path);
+  if(t->items[t->numItems].path == NULL) {
+    errno = ENOMEM;
+    return -1;
+  }
+  t->items[t->numItems].size  = size;
+  t->items[t->numItems].isDir = isDir;
+  t->numItems++;
+  if(!isDir)
+    t->totalBytes += size;
+  return 0;
+}
+
+static size_t spend(size_t budget, size_t cost) {
+  return budget > cost ? budget - cost : 0;
+}
+
+// journal lines are queued and written once per step, so a power cut loses
+// at most one step of progress
+static int journal_add(transfer_t *t, int item) {
+  const char *path = t->items[item].path;
+  size_t     len   = 12 + strlen(path);
+  char       *temp = mb_realloc(client, t->pending, t->pendingLen + len + 1);
+
+  if(temp == NULL) {
+    errno = ENOMEM;
+    return -1;
+  }
+  t->pending = temp;
+  t->pendingLen += sprintf(t->pending + t->pendingLen, "%d %s\n", item, path);
+  return 0;
+}
+
+static int journal_flush(transfer_t *t, const char *mode) {
+  void *fp;
+  int  rc = 0;
+
+  if(t->pendingLen == 0)
+    return 0;
+
+  fp = fs_open(t->journal, mode);
+  if(fp == NULL)
+    return -1;
+  if(fs_write(fp, t->pending, t->pendingLen) != (ssize_t)t->pendingLen)
+    rc = -1;
+  if(fs_close(fp) != 0)
+    rc = -1;
+  if(rc == 0)
+    t->pendingLen = 0;
+  return rc;
+}
+
+// count the leading journal entries which still match the plan. returns -1
+// if the journal belongs to a different source
+static int journal_load(transfer_t *t) {
+  struct stat statbuf;
+  char        *buf, *p, *end;
+  void        *fp;
+  int         n = 0;
+  ssize_t     len;
+
+  if(fs_stat(t->journal, &statbuf) != 0)
+    return 0;
+
+  buf = mb_malloc(client, statbuf.st_size + 1);
+  if(buf == NULL) {
+    errno = ENOMEM;
+    return -1;
+  }
+
+  // one sequential read
+  fp  = fs_open(t->journal, "rb");
+  len = fp != NULL ? fs_read(fp, buf, statbuf.st_size) : -1;
+  if(fp != NULL)
+    fs_close(fp);
+  if(len < 0) {
+    mb_free(client, buf);
+    return -1;
+  }
+  buf[len] = 0;
+
+  // header is the magic, the source and the destination
+  p = buf;
+  if(strncmp(p, JOURNAL_MAGIC "\n", sizeof(JOURNAL_MAGIC)) != 0)
+    goto mismatch;
+  p += sizeof(JOURNAL_MAGIC);
+  end = strchr(p, '\n');
+  if(end == NULL || (size_t)(end - p) != strlen(t->src) || strncmp(p, t->src, end - p) != 0)
+    goto mismatch;
+  p = end + 1;
+  end = strchr(p, '\n');
+  if(end == NULL || (size_t)(end - p) != strlen(t->dst) || strncmp(p, t->dst, end - p) != 0)
+    goto mismatch;
+  p = end + 1;
+
+  // a move interrupted while removing the source only has that left to do
+  if(len - (p - buf) >= (ssize_t)strlen(JOURNAL_COPIED)
+  && strcmp(buf + len - strlen(JOURNAL_COPIED), JOURNAL_COPIED) == 0
+  && buf[len - strlen(JOURNAL_COPIED) - 1] == '\n') {
+    t->copied = 1;
+    mb_free(client, buf);
+    return 0;
+  }
+
+  // items are completed in order; a torn last line is ignored
+  while(n < t->numItems && (end = strchr(p, '\n')) != NULL) {
+    char *path;
+    *end = 0;
+    if(strtol(p, &path, 10) != n || *path != ' ' || strcmp(path+1, t->items[n].path) != 0)
+      break;
+    n++;
+    p = end + 1;
+  }
+
+  mb_free(client, buf);
+  return n;
+
+mismatch:
+  mb_free(client, buf);
+  errno = EEXIST;
+  return -1;
+}
+
+static void finish_plan(transfer_t *t) {
+  char     dir[FILENAME_MAX];
+  char     *slash;
+  uint64_t avail;
+  int      i;
+  struct stat statbuf;
+
+  // without the destination, whatever the journal says is gone
+  t->resumed = fs_stat(t->dst, &statbuf) == 0 ? journal_load(t) : 0;
+  if(t->resumed < 0) {
+    fail(t, errno);
+    return;
+  }
+  if(t->copied && !t->move) {
+    // a move stopped while removing its source, which a copy must not finish
+    fail(t, EEXIST);
+    return;
+  }
+  if(t->copied) {
+    // the plan is whatever is left of the source
+    t->resumed   = t->numItems;
+    t->doneBytes = t->totalBytes;
+    t->current   = t->numItems - 1;
+    t->phase     = TRANSFER_REMOVE;
+    return;
+  }
+  if(t->numItems == 0) {
+    fail(t, ENOENT);
+    return;
+  }
+  for(i = 0; i < t->resumed; i++) {
+    if(!t->items[i].isDir)
+      t->doneBytes += t->items[i].size;
+  }
+
+  // check that the rest fits; backends which can't tell are trusted
+  strcpy(dir, t->journal);
+  slash = strrchr(dir, '/');
+  if(slash != NULL)
+    slash[1] = 0;
+  if(fs_space(dir, &avail) == 0 && avail < t->totalBytes - t->doneBytes) {
+    fail(t, ENOSPC);
+    return;
+  }
+
+  // rewrite the journal with only the entries that are still valid
+  t->pendingLen = 0;
+  t->pending = mb_malloc(client, strlen(JOURNAL_MAGIC) + strlen(t->src) + strlen(t->dst) + 4);
+  if(t->pending == NULL) {
+    fail(t, ENOMEM);
+    return;
+  }
+  t->pendingLen = sprintf(t->pending, "%s\n%s\n%s\n", JOURNAL_MAGIC, t->src, t->dst);
+  for(i = 0; i < t->resumed; i++) {
+    if(journal_add(t, i) != 0) {
+      fail(t, errno);
+      return;
+    }
+  }
+  if(journal_flush(t, "wb") != 0) {
+    fail(t, errno);
+    return;
+  }
+
+  t->current = t->resumed;
+  t->phase   = TRANSFER_COPY;
+}
+
+static size_t step_plan(transfer_t *t, size_t budget) {
+  char        path[FILENAME_MAX];
+  char        rel[FILENAME_MAX];
+  struct stat statbuf;
+
+  while(budget > 0 && t->phase == TRANSFER_PLAN) {
+    if(t->list == NULL) {
+      // find the next directory to expand
+      while(t->scanned < t->numItems && !t->items[t->scanned].isDir)
+        t->scanned++;
+      if(t->scanned == t->numItems) {
+        finish_plan(t);
+        break;
+      }
+
+      if(path_join(path, sizeof(path), t->src, t->items[t->scanned].path) != 0) {
+        fail(t, errno);
+        break;
+      }
+      t->listLen = scandir(path, &t->list, transfer_filter, generic_scandir_compar);
+      if(t->listLen < 0) {
+        t->list = NULL;
+        fail(t, errno ? errno : ENOMEM);
+        break;
+      }
+      t->listPos = 0;
+      if(t->list == NULL) // empty directory
+        t->scanned++;
+      budget = spend(budget, TRANSFER_ITEM_COST);
+    }
+    else if(t->listPos == t->listLen) {
+      freescandir(t->list, t->listLen);
+      t->list = NULL;
+      t->scanned++;
+    }
+    else {
+      const char *name = t->list[t->listPos++]->d_name;
+      if(path_join(rel,  sizeof(rel),  t->items[t->scanned].path, name) != 0
+      || path_join(path, sizeof(path), t->src, rel) != 0
+      || fs_stat(path, &statbuf) != 0
+      || add_item(t, rel, S_ISDIR(statbuf.st_mode) ? 0 : statbuf.st_size, S_ISDIR(statbuf.st_mode)) != 0) {
+        fail(t, errno);
+        break;
+      }
+      budget = spend(budget, TRANSFER_ITEM_COST);
+    }
+  }
+
+  return budget;
+}
+
+static size_t step_copy(transfer_t *t, size_t budget) {
+  char    src[FILENAME_MAX];
+  char    dst[FILENAME_MAX];
+  ssize_t len;
+
+  while(budget > 0 && t->current < t->numItems) {
+    transfer_item_t *item = &t->items[t->current];
+
+    if(t->in == NULL) {
+      if(path_join(src, sizeof(src), t->src, item->path) != 0
+      || path_join(dst, sizeof(dst), t->dst, item->path) != 0) {
+        fail(t, errno);
+        return 0;
+      }
+
+      if(item->isDir) {
+        if(fs_mkdir(dst) != 0 && errno != EEXIST) {
+          fail(t, errno);
+          return 0;
+        }
+        goto completed;
+      }
+
+      // a file interrupted half way is simply copied again
+      t->in = fs_open(src, "rb");
+      if(t->in == NULL) {
+        fail(t, errno);
+        return 0;
+      }
+      t->out = fs_open(dst, "wb");
+      if(t->out == NULL) {
+        fail(t, errno);
+        return 0;
+      }
+    }
+
+    len = fs_read(t->in, t->buf, TRANSFER_BUFSIZE);
+    if(len < 0 || (len > 0 && fs_write(t->out, t->buf, len) != len)) {
+      fail(t, errno);
+      return 0;
+    }
+    if(len > 0) {
+      t->doneBytes   += len;
+      t->sessionWork += len;
+      budget = spend(budget, len);
+      continue;
+    }
+
+    // end of file
+    fs_close(t->in);
+    t->in = NULL;
+    if(fs_close(t->out) != 0) {
+      t->out = NULL;
+      fail(t, errno);
+      return 0;
+    }
+    t->out = NULL;
+
+completed:
+    if(journal_add(t, t->current) != 0) {
+      fail(t, errno);
+      return 0;
+    }
+    t->current++;
+    t->sessionWork += TRANSFER_ITEM_COST;
+    budget = spend(budget, TRANSFER_ITEM_COST);
+  }
+
+  if(journal_flush(t, "ab") != 0) {
+    fail(t, errno);
+    return 0;
+  }
+
+  if(t->current == t->numItems) {
+    if(t->move) {
+      // the journal stays until the source is gone, so a move stopped
+      // half way through removing it can still be finished
+      void *fp = fs_open(t->journal, "ab");
+      if(fp == NULL || fs_write(fp, JOURNAL_COPIED, strlen(JOURNAL_COPIED)) != (ssize_t)strlen(JOURNAL_COPIED)) {
+        if(fp != NULL)
+          fs_close(fp);
+        fail(t, errno);
+        return 0;
+      }
+      if(fs_close(fp) != 0) {
+        fail(t, errno);
+        return 0;
+      }
+      t->copied  = 1;
+      t->current = t->numItems - 1;
+      t->phase   = TRANSFER_REMOVE;
+    }
+    else {
+      // the copy is complete, so there is nothing left to resume
+      fs_remove(t->journal);
+      t->phase = TRANSFER_DONE;
+    }
+  }
+
+  return budget;
+}
+
+// remove the source children first, which is the plan in reverse
+static size_t step_remove(transfer_t *t, size_t budget) {
+  char path[FILENAME_MAX];
+
+  if(!t->move) {
+    fail(t, EINVAL);
+    return 0;
+  }
+
+  while(budget > 0 && t->current >= 0) {
+    if(path_join(path, sizeof(path), t->src, t->items[t->current].path) != 0
+    || (fs_remove(path) != 0 && errno != ENOENT)) {
+      fail(t, errno);
+      return 0;
+    }
+    t->current--;
+    t->sessionWork += TRANSFER_ITEM_COST;
+    budget = spend(budget, TRANSFER_ITEM_COST);
+  }
+
+  if(t->current < 0) {
+    fs_remove(t->journal);
+    t->phase = TRANSFER_DONE;
+  }
+  return budget;
+}
+
+transfer_t* transfer_start(const char *src, const char *dst, int move) {
+  struct stat statbuf;
+  transfer_t  *t = calloc(1, sizeof(transfer_t));
+  const char  *name;
+  size_t      len;
+  int         journaled;
+
+  if(t == NULL) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  if(client < 0)
+    client = mb_register("transfer", NULL, NULL);
+  t->move  = move;
+  t->phase = TRANSFER_PLAN;
+
+  if(strlen(src) >= sizeof(t->src) || strlen(dst) >= sizeof(t->dst)) {
+    fail(t, ENAMETOOLONG);
+    return t;
+  }
+  strcpy(t->src, src);
+  strcpy(t->dst, dst);
+
+  // the journal sits next to the destination as a hidden file
+  name = strrchr(t->dst, '/');
+  name = name != NULL ? name+1 : t->dst;
+  len  = name - t->dst;
+  if(*name == 0 || len + strlen(name) + 10 >= sizeof(t->journal)) {
+    fail(t, EINVAL);
+    return t;
+  }
+  memcpy(t->journal, t->dst, len);
+  t->journal[len] = '.';
+  strcpy(t->journal + len + 1, name);
+  strcat(t->journal, ".journal");
+
+  // refuse to copy a directory into itself
+  len = strlen(t->src);
+  if(strncmp(t->dst, t->src, len) == 0 && (t->dst[len] == 0 || t->dst[len] == '/')) {
+    fail(t, EINVAL);
+    return t;
+  }
+
+  journaled = fs_stat(t->journal, &statbuf) == 0;
+  if(!journaled && fs_stat(t->dst, &statbuf) == 0) {
+    fail(t, EEXIST);
+    return t;
+  }
+
+  // a move within the same volume is only a rename
+  if(move && !journaled && fs_rename(t->src, t->dst) == 0) {
+    t->phase = TRANSFER_DONE;
+    return t;
+  }
+
+  t->buf = mb_malloc(client, TRANSFER_BUFSIZE);
+  if(t->buf == NULL) {
+    fail(t, ENOMEM);
+    return t;
+  }
+
+  // a resumed move may have removed the whole source already, which the
+  // journal confirms once planning is done
+  if(fs_stat(t->src, &statbuf) != 0) {
+    if(!(move && journaled && errno == ENOENT))
+      fail(t, errno);
+    return t;
+  }
+
+  if(add_item(t, "", S_ISDIR(statbuf.st_mode) ? 0 : statbuf.st_size, S_ISDIR(statbuf.st_mode)) != 0)
+    fail(t, ENOMEM);
+
+  return t;
+}
+
+transfer_phase_t transfer_step(transfer_t *t, size_t budget) {
+  if(t->phase == TRANSFER_PLAN)
+    budget = step_plan(t, budget);
+  if(t->phase == TRANSFER_COPY && budget > 0)
+    budget = step_copy(t, budget);
+  if(t->phase == TRANSFER_REMOVE && budget > 0)
+    budget = step_remove(t, budget);
+  return t->phase;
+}
+
+void transfer_free(transfer_t *t) {
+  int i;
+
+  if(t->in != NULL)
+    fs_close(t->in);
+  if(t->out != NULL)
+    fs_close(t->out);
+
+  // keep whatever was completed for the next attempt
+  if(t->phase == TRANSFER_COPY || t->phase == TRANSFER_ERROR)
+    journal_flush(t, "ab");
+
+  if(t->list != NULL)
+    freescandir(t->list, t->listLen);
+  for(i = 0; i < t->numItems; i++)
+    mb_free(client, t->items[i].path);
+  mb_free(client, t->items);
+  mb_free(client, t->buf);
+  mb_free(client, t->pending);
+  free(t);
+}
+
+uint64_t transfer_remaining(const transfer_t *t) {
+  uint64_t work;
+
+  switch(t->phase) {
+    case TRANSFER_COPY:
+      work  = t->totalBytes > t->doneBytes ? t->totalBytes - t->doneBytes : 0;
+      work += (uint64_t)(t->numItems - t->current) * TRANSFER_ITEM_COST;
+      if(t->move)
+        work += (uint64_t)t->numItems * TRANSFER_ITEM_COST;
+      return work;
+    case TRANSFER_REMOVE:
+      return (uint64_t)(t->current + 1) * TRANSFER_ITEM_COST;
+    default:
+      return 0;
+  }
+}
+
+uint32_t transfer_eta(const transfer_t *t, uint32_t elapsed) {
+  if(t->phase == TRANSFER_PLAN || t->sessionWork == 0)
+    return 0;
+  return transfer_remaining(t) * elapsed / t->sessionWork;
+}
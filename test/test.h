@@ -0,0 +1,59 @@
+#pragma once
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fs.h"
+
+// Minimal host test helpers. A failed check is reported and counted, and the
+// test program exits non-zero at the end.
+static int failures = 0;
+
+#define CHECK(cond) do { \
+  if(!(cond)) { \
+    fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+    failures++; \
+  } \
+} while(0)
+
+#define CHECK_EQ(a, b) do { \
+  long long _a = (long long)(a), _b = (long long)(b); \
+  if(_a != _b) { \
+    fprintf(stderr, "%s:%d: check failed: %s == %s (%lld != %lld)\n", __FILE__, __LINE__, #a, #b, _a, _b); \
+    failures++; \
+  } \
+} while(0)
+
+#define RUN(test) do { \
+  int _before = failures; \
+  test(); \
+  printf("%-32s %s\n", #test, failures == _before ? "ok" : "FAILED"); \
+} while(0)
+
+#define DONE() do { \
+  printf("%d failure%s\n", failures, failures == 1 ? "" : "s"); \
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS; \
+} while(0)
+
+// write a whole file on the current backend
+static inline int put_file(const char *path, const void *data, size_t len) {
+  void *fp = fs_open(path, "wb");
+  int  rc  = 0;
+  if(fp == NULL)
+    return -1;
+  if(fs_write(fp, data, len) != (ssize_t)len)
+    rc = -1;
+  if(fs_close(fp) != 0)
+    rc = -1;
+  return rc;
+}
+
+// read a whole file into buf, returns its length or -1
+static inline ssize_t get_file(const char *path, void *buf, size_t size) {
+  void    *fp = fs_open(path, "rb");
+  ssize_t len;
+  if(fp == NULL)
+    return -1;
+  len = fs_read(fp, buf, size);
+  fs_close(fp);
+  return len;
+}
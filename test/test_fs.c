@@ -0,0 +1,204 @@
+#include <errno.h>
+#include "test.h"
+
+static void test_mem_files(void) {
+  fs_backend_t *fs = fs_mem_create();
+  char         buf[64];
+  struct stat  st;
+
+  fs_set_backend(fs);
+  CHECK_EQ(fs_mkdir("/a"), 0);
+  CHECK_EQ(fs_mkdir("fat:/a/b/"), 0);
+  CHECK_EQ(fs_mkdir("/a"), -1);
+  CHECK_EQ(errno, EEXIST);
+
+  CHECK_EQ(put_file("/a/b/x.txt", "hello", 5), 0);
+  CHECK_EQ(fs_stat("/a/b/x.txt", &st), 0);
+  CHECK_EQ(st.st_size, 5);
+  CHECK(S_ISREG(st.st_mode));
+
+  CHECK_EQ(fs_chdir("/a/b"), 0);
+  CHECK(fs_getcwd(buf, sizeof(buf)) != NULL);
+  CHECK(strcmp(buf, "/a/b/") == 0);
+  CHECK_EQ(get_file("x.txt", buf, sizeof(buf)), 5);
+  CHECK(memcmp(buf, "hello", 5) == 0);
+
+  // append and overwrite
+  void *fp = fs_open("x.txt", "ab");
+  CHECK_EQ(fs_write(fp, " world", 6), 6);
+  fs_close(fp);
+  CHECK_EQ(get_file("x.txt", buf, sizeof(buf)), 11);
+  CHECK_EQ(put_file("x.txt", "hi", 2), 0);
+  CHECK_EQ(get_file("x.txt", buf, sizeof(buf)), 2);
+
+  CHECK_EQ(fs_open("missing", "rb") == NULL, 1);
+  CHECK_EQ(errno, ENOENT);
+
+  CHECK_EQ(fs_rename("x.txt", "../y.txt"), 0);
+  CHECK_EQ(fs_stat("/a/y.txt", &st), 0);
+  CHECK_EQ(fs_stat("/a/b/x.txt", &st), -1);
+
+  // the cwd and non-empty directories can't be removed
+  CHECK_EQ(fs_remove("/a/b"), -1);
+  CHECK_EQ(fs_chdir(".."), 0);
+  CHECK_EQ(fs_remove("/a"), -1);
+  CHECK_EQ(fs_remove("b"), 0);
+  CHECK_EQ(fs_remove("y.txt"), 0);
+  CHECK_EQ(fs_chdir("/"), 0);
+  CHECK_EQ(fs_remove("/a"), 0);
+
+  fs_destroy(fs);
+}
+
+static void test_mem_listing(void) {
+  fs_backend_t  *fs = fs_mem_create();
+  const char    *expect[] = { ".", "..", "one", "two", "sub", };
+  struct dirent *dent;
+  void          *dp;
+  int           n = 0;
+
+  fs_set_backend(fs);
+  fs_mkdir("/d");
+  put_file("/d/one", "1", 1);
+  put_file("/d/two", "2", 1);
+  fs_mkdir("/d/sub");
+
+  // creation order like FAT, with the dot entries first
+  dp = fs_opendir("/d");
+  CHECK(dp != NULL);
+  while(dp != NULL && (dent = fs_readdir(dp)) != NULL) {
+    if(n < 5)
+      CHECK(strcmp(dent->d_name, expect[n]) == 0);
+    if(strcmp(dent->d_name, "sub") == 0)
+      CHECK_EQ(dent->d_type, DT_DIR);
+    n++;
+  }
+  CHECK_EQ(n, 5);
+  if(dp != NULL)
+    fs_closedir(dp);
+
+  // the root has no dot entries
+  n  = 0;
+  dp = fs_opendir("/");
+  while(dp != NULL && fs_readdir(dp) != NULL)
+    n++;
+  CHECK_EQ(n, 1);
+  if(dp != NULL)
+    fs_closedir(dp);
+
+  fs_destroy(fs);
+}
+
+static void test_mem_capacity(void) {
+  fs_backend_t *fs = fs_mem_create();
+  char         data[1000];
+  uint64_t     avail;
+
+  fs_set_backend(fs);
+  fs_mem_set_capacity(fs, 1500);
+  memset(data, 'x', sizeof(data));
+
+  CHECK_EQ(fs_space("/", &avail), 0);
+  CHECK_EQ(avail, 1500);
+  CHECK_EQ(put_file("/a", data, sizeof(data)), 0);
+  CHECK_EQ(fs_space("/", &avail), 0);
+  CHECK_EQ(avail, 500);
+  CHECK_EQ(put_file("/b", data, sizeof(data)), -1);
+  CHECK_EQ(errno, ENOSPC);
+
+  // truncating gives the space back
+  CHECK_EQ(put_file("/a", data, 10), 0);
+  CHECK_EQ(put_file("/b", data, sizeof(data)), 0);
+
+  fs_destroy(fs);
+}
+
+static uint64_t waited;
+
+static void count_delay(uint32_t us) {
+  waited += us;
+}
+
+static void test_sdsim_timing(void) {
+  fs_sdsim_params_t params = {
+    .cmdLatency   = 100,
+    .readLatency  = 10,
+    .writeLatency = 20,
+    .readRate     = 1000000,
+    .writeRate    = 500000,
+    .delay        = count_delay,
+  };
+  fs_backend_t     *mem = fs_mem_create();
+  fs_backend_t     *sd  = fs_sdsim_create(mem, &params);
+  fs_sdsim_stats_t stats;
+  char             data[4000];
+  struct stat      st;
+  void             *fp;
+
+  fs_set_backend(sd);
+  waited = 0;
+  memset(data, 0, sizeof(data));
+
+  // open and close are commands, the write pays latency plus 4000 B at 500 KB/s
+  CHECK_EQ(put_file("/f", data, sizeof(data)), 0);
+  fs_sdsim_stats(sd, &stats);
+  CHECK_EQ(stats.calls, 3);
+  CHECK_EQ(stats.clock, 100 + 20 + 8000 + 100);
+  CHECK_EQ(stats.bytesWritten, 4000);
+
+  // reads are charged for what was actually read
+  fs_sdsim_reset(sd);
+  fp = fs_open("/f", "rb");
+  CHECK_EQ(fs_read(fp, data, sizeof(data)), 4000);
+  CHECK_EQ(fs_read(fp, data, sizeof(data)), 0);
+  fs_close(fp);
+  fs_sdsim_stats(sd, &stats);
+  CHECK_EQ(stats.clock, 100 + (10 + 4000) + 10 + 100);
+  CHECK_EQ(stats.bytesRead, 4000);
+
+  // getcwd is free, stat is a command
+  fs_sdsim_reset(sd);
+  fs_getcwd((char*)data, sizeof(data));
+  fs_stat("/f", &st);
+  fs_sdsim_stats(sd, &stats);
+  CHECK_EQ(stats.clock, 100);
+
+  // every simulated microsecond was really waited for
+  CHECK_EQ(waited, (100+20+8000+100) + (100+4010+10+100) + 100);
+
+  fs_destroy(sd);
+  fs_destroy(mem);
+}
+
+static void test_sdsim_presets(void) {
+  fs_backend_t     *mem  = fs_mem_create();
+  fs_backend_t     *slow = fs_sdsim_create(mem, &fs_sdsim_slow_card);
+  fs_backend_t     *fast = fs_sdsim_create(mem, &fs_sdsim_fast_card);
+  fs_sdsim_stats_t s, f;
+  static char      data[256*1024];
+
+  fs_set_backend(slow);
+  put_file("/big", data, sizeof(data));
+  get_file("/big", data, sizeof(data));
+  fs_set_backend(fast);
+  put_file("/big", data, sizeof(data));
+  get_file("/big", data, sizeof(data));
+
+  fs_sdsim_stats(slow, &s);
+  fs_sdsim_stats(fast, &f);
+  CHECK(s.clock > 3*f.clock);
+  CHECK_EQ(s.bytesRead, f.bytesRead);
+
+  fs_destroy(fast);
+  fs_destroy(slow);
+  fs_destroy(mem);
+}
+
+int main(void) {
+  RUN(test_mem_files);
+  RUN(test_mem_listing);
+  RUN(test_mem_capacity);
+  RUN(test_sdsim_timing);
+  RUN(test_sdsim_presets);
+  DONE();
+}
@@ -0,0 +1,178 @@
+#include <errno.h>
+#include "test.h"
+#include "membudget.h"
+#include "scandir.h"
+
+#define BLOCK  1000
+#define BLOCKS 16
+
+// a cache of fixed size blocks which drops them oldest first
+typedef struct {
+  int  id;
+  void *blocks[BLOCKS];
+  int  count;
+  int  evicted;
+} cache_t;
+
+static size_t evict(void *ctx, size_t want) {
+  cache_t *c = ctx;
+  size_t  freed = 0;
+  int     i;
+
+  for(i = 0; i < c->count && freed < want; i++) {
+    if(c->blocks[i] != NULL) {
+      mb_free(c->id, c->blocks[i]);
+      c->blocks[i] = NULL;
+      c->evicted++;
+      freed += BLOCK;
+    }
+  }
+  return freed;
+}
+
+static int fill(cache_t *c, int n) {
+  int i;
+  for(i = 0; i < n; i++) {
+    c->blocks[c->count] = mb_malloc(c->id, BLOCK);
+    if(c->blocks[c->count] == NULL)
+      return -1;
+    c->count++;
+  }
+  return 0;
+}
+
+static void drop(cache_t *c) {
+  int i;
+  for(i = 0; i < c->count; i++)
+    mb_free(c->id, c->blocks[i]);
+  mb_unregister(c->id);
+}
+
+static void test_accounting(void) {
+  int        id = mb_register("test", NULL, NULL);
+  size_t     base = mb_used();
+  mb_stats_t stats;
+  char       *p;
+
+  mb_set_limit(1024*1024);
+  p = mb_malloc(id, 100);
+  CHECK_EQ(mb_used(), base + 100);
+  p = mb_realloc(id, p, 300);
+  CHECK_EQ(mb_used(), base + 300);
+  p = mb_realloc(id, p, 50);
+  CHECK_EQ(mb_used(), base + 50);
+  mb_free(id, p);
+  CHECK_EQ(mb_used(), base);
+
+  CHECK_EQ(mb_reserve(id, 2000), 0);
+  mb_release(id, 2000);
+  CHECK_EQ(mb_stats(id, &stats), 0);
+  CHECK(strcmp(stats.name, "test") == 0);
+  CHECK_EQ(stats.used, 0);
+  CHECK_EQ(stats.peak, 2000);
+
+  mb_unregister(id);
+  CHECK_EQ(mb_stats(id, &stats), -1);
+}
+
+static void test_lru_eviction(void) {
+  cache_t a = { 0 }, b = { 0 };
+  size_t  base = mb_used();
+
+  a.id = mb_register("a", evict, &a);
+  b.id = mb_register("b", evict, &b);
+  mb_set_limit(base + 8*BLOCK);
+
+  CHECK_EQ(fill(&a, 4), 0);
+  CHECK_EQ(fill(&b, 4), 0);
+  CHECK_EQ(a.evicted + b.evicted, 0);
+
+  // a was used longest ago, so it shrinks for b
+  CHECK_EQ(fill(&b, 2), 0);
+  CHECK_EQ(a.evicted, 2);
+  CHECK_EQ(b.evicted, 0);
+
+  // touching a makes b the victim
+  mb_touch(a.id);
+  CHECK_EQ(fill(&a, 1), 0);
+  CHECK_EQ(b.evicted, 1);
+  CHECK(mb_used() <= mb_limit());
+
+  drop(&a);
+  drop(&b);
+}
+
+static void test_essential_over_limit(void) {
+  cache_t c = { 0 };
+  int     id = mb_register("essential", NULL, NULL);
+  size_t  base = mb_used();
+  void    *p;
+
+  c.id = mb_register("cache", evict, &c);
+  mb_set_limit(base + 4*BLOCK);
+  CHECK_EQ(fill(&c, 4), 0);
+
+  // memory which can't be dropped goes over the limit after the caches
+  p = mb_malloc(id, 6*BLOCK);
+  CHECK(p != NULL);
+  CHECK_EQ(c.evicted, 4);
+  CHECK(mb_used() > mb_limit());
+
+  // and the caches get nothing until it is given back
+  CHECK_EQ(fill(&c, 1), -1);
+  CHECK_EQ(errno, ENOMEM);
+  mb_free(id, p);
+  CHECK_EQ(fill(&c, 1), 0);
+
+  drop(&c);
+  mb_unregister(id);
+}
+
+// browsing a folder much bigger than the budget still lists it
+static void test_large_folder(void) {
+  fs_backend_t  *fs = fs_mem_create();
+  cache_t       c = { 0 };
+  struct dirent **list;
+  char          name[32];
+  int           i, n;
+
+  fs_set_backend(fs);
+  fs_mkdir("/big");
+  for(i = 0; i < 3000; i++) {
+    sprintf(name, "/big/file%04d.txt", i);
+    put_file(name, "", 0);
+  }
+
+  c.id = mb_register("cache", evict, &c);
+  mb_set_limit(mb_used() + 64*1024);
+  CHECK_EQ(fill(&c, BLOCKS), 0);
+
+  fs_chdir("/big");
+  n = scandir(".", &list, generic_scandir_filter, generic_scandir_compar);
+  CHECK_EQ(n, 3001);
+  CHECK(n > 0 && strcmp(list[0]->d_name, "..") == 0);
+  CHECK(n > 1 && strcmp(list[1]->d_name, "file0000.txt") == 0);
+  CHECK_EQ(c.evicted, BLOCKS);
+  if(n > 0)
+    freescandir(list, n);
+
+  // a folder which can't be read still has a way out
+  n = scandir("/missing", &list, generic_scandir_filter, generic_scandir_compar);
+  CHECK_EQ(n, -1);
+  n = parentscandir(&list);
+  CHECK_EQ(n, 1);
+  CHECK(n == 1 && strcmp(list[0]->d_name, "..") == 0 && list[0]->d_type == DT_DIR);
+  if(n > 0)
+    freescandir(list, n);
+
+  drop(&c);
+  fs_destroy(fs);
+}
+
+int main(void) {
+  RUN(test_accounting);
+  RUN(test_lru_eviction);
+  RUN(test_essential_over_limit);
+  RUN(test_large_folder);
+  DONE();
+}
@@ -0,0 +1,600 @@
+#include <errno.h>
+#include "test.h"
+#include "membudget.h"
+#include "scandir.h"
+#include "thumbs.h"
+
+// colors are multiples of 8, so BMP and 16-bit GRF agree exactly
+static uint32_t color(int x, int y) {
+  return ((x*8) & 0xF8) << 16 | ((y*8) & 0xF8) << 8 | ((x+y)*8 & 0xF8);
+}
+
+static unsigned char *put32(unsigned char *p, uint32_t v) {
+  p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+  return p + 4;
+}
+
+static unsigned char *put16(unsigned char *p, uint32_t v) {
+  p[0] = v; p[1] = v >> 8;
+  return p + 2;
+}
+
+static void write_bmp(const char *path, int w, int h, int topDown) {
+  int           rowSize = (w*3 + 3) & ~3;
+  size_t        len = 54 + rowSize*h;
+  unsigned char *buf = calloc(1, len), *p = buf;
+  int           x, y;
+
+  *p++ = 'B'; *p++ = 'M';
+  p = put32(p, len);
+  p = put32(p, 0);
+  p = put32(p, 54);
+  p = put32(p, 40);
+  p = put32(p, w);
+  p = put32(p, topDown ? -h : h);
+  p = put16(p, 1);
+  p = put16(p, 24);
+  for(y = 0; y < h; y++) {
+    unsigned char *row = buf + 54 + rowSize*(topDown ? y : h-1-y);
+    for(x = 0; x < w; x++) {
+      uint32_t c = color(x, y);
+      row[x*3]   = c;
+      row[x*3+1] = c >> 8;
+      row[x*3+2] = c >> 16;
+    }
+  }
+  CHECK_EQ(put_file(path, buf, len), 0);
+  free(buf);
+}
+
+static size_t lz77(const unsigned char *src, size_t len, unsigned char *out) {
+  size_t i = 0, o = 0;
+
+  while(i < len) {
+    size_t flags = o++;
+    int    bit;
+    out[flags] = 0;
+    for(bit = 7; bit >= 0 && i < len; bit--) {
+      size_t best = 0, disp = 0, d;
+      for(d = 1; d <= 4096 && d <= i; d++) {
+        size_t n = 0;
+        while(n < 18 && i + n < len && src[i+n] == src[i+n-d])
+          n++;
+        if(n > best) {
+          best = n;
+          disp = d;
+        }
+      }
+      if(best >= 3) {
+        out[flags] |= 1 << bit;
+        out[o++] = (best-3) << 4 | (disp-1) >> 8;
+        out[o++] = disp-1;
+        i += best;
+      }
+      else
+        out[o++] = src[i++];
+    }
+  }
+  return o;
+}
+
+static size_t rle(const unsigned char *src, size_t len, unsigned char *out) {
+  size_t i = 0, o = 0;
+
+  while(i < len) {
+    size_t n = 1;
+    while(n < 130 && i + n < len && src[i+n] == src[i])
+      n++;
+    if(n >= 3) {
+      out[o++] = 0x80 | (n-3);
+      out[o++] = src[i];
+      i += n;
+    }
+    else {
+      size_t start = o++;
+      n = 0;
+      while(n < 128 && i < len && !(i + 2 < len && src[i] == src[i+1] && src[i] == src[i+2])) {
+        out[o++] = src[i++];
+        n++;
+      }
+      out[start] = n-1;
+    }
+  }
+  return o;
+}
+
+// type is 0x00, 0x10 or 0x30, alpha sets bit 15 on the left half only
+static void write_grf(const char *path, int w, int h, int type, int alpha) {
+  size_t        rawLen = w*h*2;
+  unsigned char *raw = malloc(rawLen);
+  unsigned char *gfx = malloc(rawLen*2 + 16);
+  unsigned char *buf = malloc(rawLen*2 + 128), *p;
+  size_t        gfxLen;
+  int           x, y;
+
+  for(y = 0; y < h; y++) {
+    for(x = 0; x < w; x++) {
+      uint32_t c = color(x, y);
+      uint32_t v = (c >> 19 & 31) | (c >> 11 & 31) << 5 | (c >> 3 & 31) << 10;
+      if(!alpha || x < w/2)
+        v |= 0x8000;
+      put16(&raw[(y*w + x)*2], v);
+    }
+  }
+
+  put32(gfx, type | rawLen << 8);
+  if(type == 0x10)
+    gfxLen = 4 + lz77(raw, rawLen, gfx+4);
+  else if(type == 0x30)
+    gfxLen = 4 + rle(raw, rawLen, gfx+4);
+  else {
+    memcpy(gfx+4, raw, rawLen);
+    gfxLen = 4 + rawLen;
+  }
+
+  p = buf;
+  memcpy(p, "RIFF", 4);
+  p = put32(p+4, 0);
+  memcpy(p, "GRF ", 4);
+  p += 4;
+  memcpy(p, "HDR ", 4);
+  p = put32(p+4, 20);
+  memset(p, 0, 20);
+  p[0] = 16;
+  put32(&p[8],  w);
+  put32(&p[12], h);
+  p += 20;
+  memcpy(p, "GFX ", 4);
+  p = put32(p+4, gfxLen);
+  memcpy(p, gfx, gfxLen);
+  p += gfxLen + (gfxLen & 1);
+  put32(buf+4, p - buf - 8);
+
+  CHECK_EQ(put_file(path, buf, p - buf), 0);
+  free(buf);
+  free(gfx);
+  free(raw);
+}
+
+static unsigned char *put32be(unsigned char *p, uint32_t v) {
+  p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+  return p + 4;
+}
+
+static uint32_t crc32(const unsigned char *p, size_t len) {
+  uint32_t crc = 0xFFFFFFFF;
+  int      k;
+
+  while(len-- > 0) {
+    crc ^= *p++;
+    for(k = 0; k < 8; k++)
+      crc = crc >> 1 ^ (crc & 1 ? 0xEDB88320 : 0);
+  }
+  return ~crc;
+}
+
+static unsigned char *png_chunk(unsigned char *p, const char *type, const void *data, size_t len) {
+  p = put32be(p, len);
+  memcpy(p, type, 4);
+  memcpy(p+4, data, len);
+  return put32be(p+4+len, crc32(p, 4+len));
+}
+
+// 32x16 truecolour rows, filters 0 to 4 in turn, deflated with dynamic codes
+static const unsigned char rgbDeflated[325] = {
+  0x78, 0xda, 0xd5, 0xd1, 0x91, 0x9b, 0xb5, 0x40, 0x1c, 0xc5, 0xf1, 0x73,
+  0xf7, 0x5d, 0x18, 0x1c, 0x0c, 0x83, 0x85, 0x83, 0x83, 0x83, 0x61, 0xf8,
+  0xc3, 0xc1, 0x30, 0x0c, 0x0f, 0x86, 0x61, 0x18, 0x86, 0x61, 0x18, 0x86,
+  0x61, 0x18, 0x86, 0x61, 0x18, 0xee, 0xbb, 0x7f, 0xc4, 0x85, 0xfb, 0x3c,
+  0x5f, 0x3e, 0x07, 0x3e, 0x00, 0xe0, 0xe0, 0x3c, 0x7c, 0x86, 0x2c, 0x47,
+  0x4e, 0x30, 0x20, 0x44, 0xc4, 0x02, 0x45, 0x89, 0xd2, 0x60, 0x09, 0xa9,
+  0x42, 0x55, 0xa3, 0x6e, 0xd0, 0x08, 0x6a, 0xd1, 0x76, 0xe8, 0x7a, 0xf4,
+  0x03, 0x86, 0x11, 0xe3, 0x84, 0x69, 0xc6, 0xbc, 0x60, 0x59, 0xb1, 0x6e,
+  0xd8, 0x76, 0xec, 0x07, 0x8e, 0x13, 0xe7, 0x85, 0xeb, 0xc6, 0xfd, 0xe0,
+  0x79, 0xc1, 0xb9, 0xff, 0x07, 0xef, 0xeb, 0x0b, 0xef, 0xdd, 0x77, 0xff,
+  0xe0, 0xfd, 0xf7, 0xb7, 0x7b, 0x63, 0x7f, 0x3f, 0x78, 0x6b, 0xa4, 0x63,
+  0xf0, 0x8c, 0x19, 0x8b, 0x9c, 0x25, 0x69, 0x81, 0x29, 0xb2, 0x2a, 0x58,
+  0x97, 0x6c, 0x8c, 0x4a, 0x6c, 0x2b, 0x76, 0x35, 0xfb, 0x86, 0x83, 0x38,
+  0xb6, 0x9c, 0x3a, 0xce, 0x3d, 0x97, 0x81, 0xeb, 0xc8, 0x6d, 0xe2, 0x3e,
+  0xf3, 0x58, 0x78, 0xae, 0xbc, 0x36, 0xde, 0x3b, 0x9f, 0x83, 0x38, 0xe9,
+  0x2e, 0xfa, 0x9b, 0xd9, 0xc3, 0xfc, 0x85, 0x10, 0x3e, 0x1d, 0xf9, 0xe7,
+  0xe7, 0xd3, 0x91, 0xcd, 0x9c, 0x25, 0x6f, 0x55, 0x66, 0x75, 0x6e, 0x0d,
+  0x4d, 0xc1, 0xda, 0x68, 0x5d, 0x61, 0x7d, 0x69, 0x83, 0xd9, 0x98, 0x6c,
+  0xaa, 0x6c, 0xae, 0x6d, 0x69, 0x6c, 0x95, 0x6d, 0xad, 0xed, 0x9d, 0x1d,
+  0xbd, 0x9d, 0x83, 0x5d, 0xa3, 0xdd, 0x93, 0x3d, 0xb3, 0x61, 0x31, 0xb7,
+  0x9a, 0xdf, 0x2c, 0xdb, 0x2d, 0x3f, 0x8c, 0xa7, 0x85, 0xcb, 0xe2, 0x6d,
+  0xc5, 0x63, 0xe5, 0x0b, 0x29, 0x7d, 0x3a, 0x72, 0x8c, 0x9f, 0x8e, 0x2c,
+  0x39, 0xb5, 0x5e, 0x5d, 0xa6, 0x3e, 0xd7, 0x40, 0x8d, 0x41, 0x53, 0xd4,
+  0x5c, 0x68, 0x29, 0xb5, 0x9a, 0xb6, 0xa4, 0xbd, 0xd2, 0x51, 0xeb, 0x6c,
+  0x74, 0x49, 0x77, 0xab, 0xa7, 0x13, 0x7a, 0xb9, 0x41, 0x7e, 0x54, 0x36,
+  0x29, 0x9f, 0xc5, 0x45, 0x61, 0x55, 0xdc, 0x54, 0xec, 0x2a, 0x0f, 0xd9,
+  0xa9, 0x74, 0xa9, 0xba, 0x55, 0x3f, 0x6a, 0x7e, 0x01, 0xd9, 0xa4, 0xb0,
+  0xcf,
+};
+
+// rows of color(), in PNG sample order, filtered with filters 0 to 4 in turn
+static size_t png_rows(int w, int h, int colorType, unsigned char *out) {
+  int           bpp = colorType == 6 ? 4 : colorType == 3 ? 1 : 3;
+  size_t        rowLen = w*bpp, o = 0;
+  unsigned char *prev = calloc(1, rowLen), *cur = malloc(rowLen);
+  int           x, y;
+  size_t        i;
+
+  for(y = 0; y < h; y++) {
+    for(x = 0; x < w; x++) {
+      uint32_t c = color(x, y);
+      if(colorType == 3)
+        cur[x] = y*w + x;
+      else {
+        cur[x*bpp]   = c >> 16;
+        cur[x*bpp+1] = c >> 8;
+        cur[x*bpp+2] = c;
+        if(colorType == 6)
+          cur[x*bpp+3] = x < w/2 ? 0xFF : 0;
+      }
+    }
+    out[o++] = y % 5;
+    for(i = 0; i < rowLen; i++) {
+      int a = i >= (size_t)bpp ? cur[i-bpp] : 0, b = prev[i], c = i >= (size_t)bpp ? prev[i-bpp] : 0;
+      int pa = abs(b-c), pb = abs(a-c), pc = abs(a+b-2*c);
+      int pred[5] = { 0, a, b, (a+b)/2, pa <= pb && pa <= pc ? a : pb <= pc ? b : c };
+      out[o++] = cur[i] - pred[y % 5];
+    }
+    memcpy(prev, cur, rowLen);
+  }
+  free(prev);
+  free(cur);
+  return o;
+}
+
+static uint32_t adler32(const unsigned char *p, size_t len) {
+  uint32_t a = 1, b = 0;
+
+  while(len-- > 0) {
+    a = (a + *p++) % 65521;
+    b = (b + a) % 65521;
+  }
+  return b << 16 | a;
+}
+
+// zlib stream of stored blocks of at most 1000 bytes
+static size_t deflate_stored(const unsigned char *src, size_t len, unsigned char *out) {
+  size_t i, o = 0;
+
+  out[o++] = 0x78;
+  out[o++] = 0x01;
+  for(i = 0; i < len || i == 0; i += 1000) {
+    size_t n = len - i < 1000 ? len - i : 1000;
+    out[o++] = i + n >= len;
+    put16(&out[o], n);
+    put16(&out[o+2], ~n);
+    memcpy(&out[o+4], src+i, n);
+    o += 4 + n;
+  }
+  put32be(&out[o], adler32(src, len));
+  return o + 4;
+}
+
+// zlib stream of one block of fixed code literals, with a 512 byte window
+static size_t deflate_fixed(const unsigned char *src, size_t len, unsigned char *out) {
+  uint32_t bits = 0;
+  int      count = 0, n, k;
+  size_t   i, o = 0;
+
+  out[o++] = 0x18;
+  out[o++] = 0x19;
+
+  // final block, fixed codes
+  bits  = 3;
+  count = 3;
+  for(i = 0; i <= len; i++) {
+    uint32_t code;
+    if(i == len) {
+      code = 0;
+      n    = 7;
+    }
+    else if(src[i] < 144) {
+      code = 0x30 + src[i];
+      n    = 8;
+    }
+    else {
+      code = 0x190 + src[i] - 144;
+      n    = 9;
+    }
+    // Huffman codes go out high bit first
+    for(k = n-1; k >= 0; k--)
+      bits |= (code >> k & 1) << count++;
+    while(count >= 8) {
+      out[o++] = bits;
+      bits >>= 8;
+      count -= 8;
+    }
+  }
+  if(count > 0)
+    out[o++] = bits;
+  put32be(&out[o], adler32(src, len));
+  return o + 4;
+}
+
+// the image data is split over two IDAT chunks
+static void write_png(const char *path, int w, int h, int colorType,
+                      const unsigned char *z, size_t zLen) {
+  unsigned char *buf = malloc(zLen + 3*256 + 128), *p = buf;
+  unsigned char ihdr[13], pal[256*3];
+  int           i;
+
+  memcpy(p, "\x89PNG\r\n\x1a\n", 8);
+  put32be(ihdr, w);
+  put32be(ihdr+4, h);
+  ihdr[8]  = 8;
+  ihdr[9]  = colorType;
+  ihdr[10] = ihdr[11] = ihdr[12] = 0;
+  p = png_chunk(p+8, "IHDR", ihdr, 13);
+  p = png_chunk(p, "tEXt", "Comment\0test", 12);
+  if(colorType == 3) {
+    for(i = 0; i < 256; i++) {
+      uint32_t c = color(i % w, i / w);
+      pal[i*3]   = c >> 16;
+      pal[i*3+1] = c >> 8;
+      pal[i*3+2] = c;
+    }
+    p = png_chunk(p, "PLTE", pal, 256*3);
+  }
+  p = png_chunk(p, "IDAT", z, zLen/2);
+  p = png_chunk(p, "IDAT", z + zLen/2, zLen - zLen/2);
+  p = png_chunk(p, "IEND", "", 0);
+  CHECK_EQ(put_file(path, buf, p - buf), 0);
+  free(buf);
+}
+
+static fs_backend_t* make_images(void) {
+  fs_backend_t *fs = fs_mem_create();
+
+  fs_set_backend(fs);
+  fs_mkdir("/img");
+  write_bmp("/img/a.bmp",   64, 32, 0);
+  write_bmp("/img/top.bmp", 64, 32, 1);
+  write_grf("/img/raw.grf", 64, 32, 0x00, 0);
+  write_grf("/img/lz.grf",  64, 32, 0x10, 0);
+  write_grf("/img/rle.grf", 64, 32, 0x30, 0);
+  write_grf("/img/half.grf", 64, 32, 0x10, 1);
+  put_file("/img/bad.bmp", "BM not really", 13);
+  return fs;
+}
+
+static void test_decode(void) {
+  fs_backend_t *fs = make_images();
+  uint16_t     bmp[THUMB_PIXELS], other[THUMB_PIXELS];
+  int          x, y;
+
+  CHECK_EQ(thumb_decode("/img/a.bmp", bmp), 0);
+
+  // 2:1 keeps the aspect, centered with transparent bands
+  for(y = 0; y < THUMB_SIZE; y++) {
+    for(x = 0; x < THUMB_SIZE; x++)
+      CHECK_EQ(!!(bmp[y*THUMB_SIZE + x] & 0x8000), y >= 4 && y < 12);
+  }
+
+  // top-left box of 4x4 source pixels averages to x=1.5, y=1.5
+  CHECK_EQ(bmp[4*THUMB_SIZE] & 0x7FFF, (12>>3) | (12>>3) << 5 | (24>>3) << 10);
+
+  CHECK_EQ(thumb_decode("/img/top.bmp", other), 0);
+  CHECK(memcmp(bmp, other, sizeof(bmp)) == 0);
+  CHECK_EQ(thumb_decode("/img/raw.grf", other), 0);
+  CHECK(memcmp(bmp, other, sizeof(bmp)) == 0);
+  CHECK_EQ(thumb_decode("/img/lz.grf", other), 0);
+  CHECK(memcmp(bmp, other, sizeof(bmp)) == 0);
+  CHECK_EQ(thumb_decode("/img/rle.grf", other), 0);
+  CHECK(memcmp(bmp, other, sizeof(bmp)) == 0);
+
+  // only the opaque half shows
+  CHECK_EQ(thumb_decode("/img/half.grf", other), 0);
+  CHECK(other[8*THUMB_SIZE + 2] & 0x8000);
+  CHECK(!(other[8*THUMB_SIZE + 13] & 0x8000));
+
+  CHECK_EQ(thumb_decode("/img/bad.bmp", other), -1);
+  CHECK_EQ(thumb_decode("/img/missing.bmp", other), -1);
+
+  fs_destroy(fs);
+}
+
+// PNG matches the BMP of the same pixels, whichever way it was deflated
+static void test_png(void) {
+  fs_backend_t  *fs = fs_mem_create();
+  unsigned char *rows = malloc(64*1024), *z = malloc(64*1024);
+  uint16_t      bmp[THUMB_PIXELS], png[THUMB_PIXELS];
+  size_t        len;
+  int           x, y;
+
+  fs_set_backend(fs);
+  write_bmp("/rgb.bmp", 32, 16, 0);
+  write_bmp("/pal.bmp", 16, 16, 0);
+  write_png("/rgb.png", 32, 16, 2, rgbDeflated, sizeof(rgbDeflated));
+  len = png_rows(16, 16, 3, rows);
+  write_png("/pal.png", 16, 16, 3, z, deflate_fixed(rows, len, z));
+  len = png_rows(32, 16, 6, rows);
+  write_png("/alpha.png", 32, 16, 6, z, deflate_stored(rows, len, z));
+  write_png("/short.png", 32, 16, 2, rgbDeflated, sizeof(rgbDeflated)/2);
+
+  CHECK(thumb_is_image("photo.PNG"));
+  CHECK_EQ(thumb_decode("/rgb.bmp", bmp), 0);
+  CHECK_EQ(thumb_decode("/rgb.png", png), 0);
+  CHECK(memcmp(bmp, png, sizeof(bmp)) == 0);
+
+  CHECK_EQ(thumb_decode("/pal.bmp", bmp), 0);
+  CHECK_EQ(thumb_decode("/pal.png", png), 0);
+  CHECK(memcmp(bmp, png, sizeof(bmp)) == 0);
+
+  // only the opaque half shows, in the colors of the BMP
+  CHECK_EQ(thumb_decode("/rgb.bmp", bmp), 0);
+  CHECK_EQ(thumb_decode("/alpha.png", png), 0);
+  for(y = 0; y < THUMB_SIZE; y++) {
+    for(x = 0; x < THUMB_SIZE; x++) {
+      int i = y*THUMB_SIZE + x;
+      CHECK_EQ(png[i], x < THUMB_SIZE/2 ? bmp[i] : 0);
+    }
+  }
+
+  CHECK_EQ(thumb_decode("/short.png", png), -1);
+
+  free(rows);
+  free(z);
+  fs_set_backend(NULL);
+  fs_destroy(fs);
+}
+
+static int list_dir(const char *dir, struct dirent ***list) {
+  fs_chdir(dir);
+  return scandir(".", list, generic_scandir_filter, generic_scandir_compar);
+}
+
+// a big image is spread over many steps, each reading about the budget
+static void test_step_budget(void) {
+  fs_backend_t     *mem = fs_mem_create();
+  fs_backend_t     *sd  = fs_sdsim_create(mem, &fs_sdsim_slow_card);
+  fs_sdsim_stats_t stats;
+  struct dirent    **list;
+  thumbcache_t     *tc;
+  int              n, i, steps = 0, changed = -1;
+
+  fs_set_backend(mem);
+  fs_mkdir("/big");
+  write_bmp("/big/big.bmp", 1024, 512, 0);
+  fs_set_backend(sd);
+
+  n  = list_dir("/big", &list);
+  tc = thumbs_open(list, n);
+  CHECK(tc != NULL);
+  i = n - 1;
+
+  while(changed < 0 && steps < 10000) {
+    size_t budget = 16*1024;
+    fs_sdsim_reset(sd);
+    changed = thumbs_step(tc, 0, n, &budget);
+    fs_sdsim_stats(sd, &stats);
+    CHECK(stats.bytesRead <= 16*1024 + 1024*3 + 1024);
+    steps++;
+  }
+  CHECK_EQ(changed, i);
+  CHECK(steps > 50);
+  CHECK(thumbs_get(tc, i) != NULL);
+
+  thumbs_close(tc);
+  freescandir(list, n);
+  fs_set_backend(NULL);
+  fs_destroy(sd);
+  fs_destroy(mem);
+}
+
+#define MANY 40
+
+// walk the folder a few rows at a time, as scrolling does, checking every
+// thumbnail that shows up against a decode straight from mem
+static void walk(thumbcache_t *tc, struct dirent **list, int n, fs_backend_t *mem) {
+  fs_backend_t *fs = fs_get_backend();
+  uint16_t     expect[THUMB_PIXELS];
+  int          first, k, steps;
+
+  for(first = 0; first < n; first += 4) {
+    int last = first + 4 < n ? first + 4 : n;
+    for(steps = 0; steps < 1000; steps++) {
+      size_t budget = 64*1024;
+      int    i = thumbs_step(tc, first, last, &budget);
+      if(i >= 0 && thumbs_get(tc, i) != NULL) {
+        fs_set_backend(mem);
+        CHECK_EQ(thumb_decode(list[i]->d_name, expect), 0);
+        fs_set_backend(fs);
+        CHECK(memcmp(thumbs_get(tc, i), expect, sizeof(expect)) == 0);
+      }
+      for(k = first; k < last && tc->thumbs[k].state != THUMB_PENDING
+                              && tc->thumbs[k].state != THUMB_EVICTED; k++)
+        ;
+      if(k == last)
+        break;
+    }
+    for(k = first; k < last; k++)
+      CHECK(tc->thumbs[k].state == THUMB_READY || tc->thumbs[k].state == THUMB_NONE);
+  }
+}
+
+// thumbnails dropped for memory survive a save, and come back from the cache
+// file rather than being decoded again
+static void test_cache_eviction(void) {
+  fs_backend_t     *mem = fs_mem_create();
+  fs_backend_t     *sd  = fs_sdsim_create(mem, &fs_sdsim_slow_card);
+  fs_sdsim_stats_t stats;
+  mb_stats_t       mbs;
+  struct stat      st;
+  struct dirent    **list;
+  thumbcache_t     *tc;
+  char             name[32];
+  size_t           limit = mb_limit();
+  int              n, i, images = 0;
+
+  fs_set_backend(mem);
+  fs_mkdir("/many");
+  for(i = 0; i < MANY; i++) {
+    snprintf(name, sizeof(name), "/many/x%02d.bmp", i);
+    write_bmp(name, 32, 32, 0);
+  }
+  fs_set_backend(sd);
+
+  n  = list_dir("/many", &list);
+  tc = thumbs_open(list, n);
+  walk(tc, list, n, mem);
+  CHECK_EQ(thumbs_save(tc), 0);
+  thumbs_close(tc);
+  freescandir(list, n);
+
+  // one new decode to save, while most of the rest gets evicted
+  fs_set_backend(mem);
+  write_bmp("/many/x05.bmp", 64, 32, 0);
+  fs_set_backend(sd);
+
+  n  = list_dir("/many", &list);
+  mb_set_limit(mb_used() + 28*1024);
+  tc = thumbs_open(list, n);
+  walk(tc, list, n, mem);
+  mb_stats(tc->client, &mbs);
+  CHECK(mbs.evictions > 0);
+  CHECK(tc->dirty);
+  CHECK_EQ(thumbs_save(tc), 0);
+  thumbs_close(tc);
+  freescandir(list, n);
+  mb_set_limit(limit);
+
+  n  = list_dir("/many", &list);
+  mb_set_limit(mb_used() + 28*1024);
+  tc = thumbs_open(list, n);
+  CHECK(mb_used() <= mb_limit());
+  for(i = 0; i < n; i++) {
+    if(tc->thumbs[i].state != THUMB_NONE) {
+      CHECK(tc->thumbs[i].keyed && !tc->thumbs[i].failed && tc->thumbs[i].stored != 0);
+      images++;
+    }
+  }
+  CHECK_EQ(images, MANY);
+
+  // at most one pass over the cache file, and never the images
+  CHECK_EQ(fs_stat(THUMB_FILE, &st), 0);
+  fs_sdsim_reset(sd);
+  walk(tc, list, n, mem);
+  fs_sdsim_stats(sd, &stats);
+  CHECK(stats.bytesRead <= (uint64_t)st.st_size);
+  CHECK(!tc->dirty);
+  thumbs_close(tc);
+  freescandir(list, n);
+  mb_set_limit(limit);
+
+  fs_set_backend(NULL);
+  fs_destroy(sd);
+  fs_destroy(mem);
+}
+
+int main(void) {
+  RUN(test_decode);
+  RUN(test_png);
+  RUN(test_step_budget);
+  RUN(test_cache_eviction);
+  DONE();
+}
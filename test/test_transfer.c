@@ -0,0 +1,254 @@
+#include <errno.h>
+#include "test.h"
+#include "transfer.h"
+
+#define BUDGET (16*1024)
+
+static char data[100*1024];
+
+// /src holds a big file, a nested directory and an empty one
+static fs_backend_t* make_tree(void) {
+  fs_backend_t *fs = fs_mem_create();
+  int          i;
+
+  for(i = 0; i < (int)sizeof(data); i++)
+    data[i] = i*7 + i/251;
+
+  fs_set_backend(fs);
+  fs_mkdir("/src");
+  fs_mkdir("/src/sub");
+  fs_mkdir("/src/empty");
+  put_file("/src/a.bin",     data,   sizeof(data));
+  put_file("/src/sub/b.bin", data+1, 5000);
+  put_file("/src/sub/c.txt", "",     0);
+  return fs;
+}
+
+// the files of make_tree() under root
+static void check_tree(const char *root) {
+  static char buf[sizeof(data)+1];
+  char        path[256];
+  struct stat st;
+
+  sprintf(path, "%s/a.bin", root);
+  CHECK_EQ(get_file(path, buf, sizeof(buf)), sizeof(data));
+  CHECK(memcmp(buf, data, sizeof(data)) == 0);
+  sprintf(path, "%s/sub/b.bin", root);
+  CHECK_EQ(get_file(path, buf, sizeof(buf)), 5000);
+  CHECK(memcmp(buf, data+1, 5000) == 0);
+  sprintf(path, "%s/sub/c.txt", root);
+  CHECK_EQ(get_file(path, buf, sizeof(buf)), 0);
+  sprintf(path, "%s/empty", root);
+  CHECK(fs_stat(path, &st) == 0 && S_ISDIR(st.st_mode));
+}
+
+static int exists(const char *path) {
+  struct stat st;
+  return fs_stat(path, &st) == 0;
+}
+
+static transfer_phase_t run(transfer_t *t) {
+  int steps = 0;
+  while(t->phase != TRANSFER_DONE && t->phase != TRANSFER_ERROR && steps++ < 10000)
+    transfer_step(t, BUDGET);
+  return t->phase;
+}
+
+static transfer_phase_t run_until(transfer_t *t, transfer_phase_t phase, int current) {
+  while(t->phase < phase || (t->phase == phase && phase == TRANSFER_COPY && t->current < current))
+    transfer_step(t, BUDGET);
+  return t->phase;
+}
+
+static void test_copy(void) {
+  fs_backend_t *fs = make_tree();
+  transfer_t   *t  = transfer_start("/src", "/dst", 0);
+
+  CHECK_EQ(t->phase, TRANSFER_PLAN);
+  CHECK_EQ(transfer_eta(t, 10), 0);
+  CHECK_EQ(run(t), TRANSFER_DONE);
+  CHECK_EQ(t->numItems, 6);
+  CHECK_EQ(t->totalBytes, sizeof(data) + 5000);
+  CHECK_EQ(t->doneBytes, t->totalBytes);
+  transfer_free(t);
+
+  check_tree("/dst");
+  check_tree("/src");
+  CHECK(!exists("/.dst.journal"));
+  fs_destroy(fs);
+}
+
+static void test_copy_resume(void) {
+  fs_backend_t *fs = make_tree();
+  transfer_t   *t  = transfer_start("/src", "/dst", 0);
+
+  int          done;
+
+  // stop in the middle of the copy with some items done
+  CHECK_EQ(run_until(t, TRANSFER_COPY, 2), TRANSFER_COPY);
+  CHECK(transfer_remaining(t) > 0);
+  CHECK(transfer_eta(t, 10) > 0);
+  done = t->current;
+  transfer_free(t);
+  CHECK(exists("/.dst.journal"));
+
+  t = transfer_start("/src", "/dst", 0);
+  CHECK_EQ(run(t), TRANSFER_DONE);
+  CHECK_EQ(t->resumed, done);
+  transfer_free(t);
+
+  check_tree("/dst");
+  CHECK(!exists("/.dst.journal"));
+  fs_destroy(fs);
+}
+
+static void test_copy_errors(void) {
+  fs_backend_t *fs = make_tree();
+  transfer_t   *t;
+
+  t = transfer_start("/src", "/src/sub/dst", 0);
+  CHECK_EQ(t->phase, TRANSFER_ERROR);
+  CHECK_EQ(t->error, EINVAL);
+  transfer_free(t);
+
+  fs_mkdir("/dst");
+  t = transfer_start("/src", "/dst", 0);
+  CHECK_EQ(t->phase, TRANSFER_ERROR);
+  CHECK_EQ(t->error, EEXIST);
+  transfer_free(t);
+
+  // the space check happens before anything is written
+  fs_mem_set_capacity(fs, sizeof(data) + 5000 + 1000);
+  t = transfer_start("/src", "/copy", 0);
+  CHECK_EQ(run(t), TRANSFER_ERROR);
+  CHECK_EQ(t->error, ENOSPC);
+  transfer_free(t);
+  CHECK(!exists("/copy"));
+
+  fs_destroy(fs);
+}
+
+static void test_move_rename(void) {
+  fs_backend_t *fs = make_tree();
+  transfer_t   *t  = transfer_start("/src", "/moved", 1);
+
+  CHECK_EQ(t->phase, TRANSFER_DONE);
+  transfer_free(t);
+  check_tree("/moved");
+  CHECK(!exists("/src"));
+  fs_destroy(fs);
+}
+
+// a second volume, where moving means copying and removing
+static int cross_rename(void *ctx, const char *from, const char *to) {
+  errno = EXDEV;
+  return -1;
+}
+
+static void test_move_resume_remove(void) {
+  fs_backend_t *fs = make_tree();
+  fs_backend_t other = *fs;
+  transfer_t   *t;
+
+  other.rename  = cross_rename;
+  other.destroy = NULL;
+  fs_set_backend(&other);
+
+  // cancelled while removing the source
+  t = transfer_start("/src", "/dst", 1);
+  CHECK_EQ(run_until(t, TRANSFER_REMOVE, 0), TRANSFER_REMOVE);
+  transfer_step(t, TRANSFER_ITEM_COST);
+  transfer_step(t, TRANSFER_ITEM_COST);
+  CHECK_EQ(t->phase, TRANSFER_REMOVE);
+  transfer_free(t);
+  CHECK(exists("/.dst.journal"));
+  CHECK(!exists("/src/a.bin"));
+  CHECK(exists("/src"));
+
+  // pasting again finishes the removal instead of failing on /dst
+  t = transfer_start("/src", "/dst", 1);
+  CHECK_EQ(run(t), TRANSFER_DONE);
+  CHECK(t->copied);
+  transfer_free(t);
+  check_tree("/dst");
+  CHECK(!exists("/src"));
+  CHECK(!exists("/.dst.journal"));
+
+  fs_set_backend(NULL);
+  fs_destroy(fs);
+}
+
+// a copy never finishes the removal a cancelled move left behind
+static void test_copy_after_move_removal(void) {
+  fs_backend_t *fs = make_tree();
+  fs_backend_t other = *fs;
+  transfer_t   *t;
+
+  other.rename  = cross_rename;
+  other.destroy = NULL;
+  fs_set_backend(&other);
+
+  t = transfer_start("/src", "/dst", 1);
+  CHECK_EQ(run_until(t, TRANSFER_REMOVE, 0), TRANSFER_REMOVE);
+  transfer_step(t, TRANSFER_ITEM_COST);
+  transfer_free(t);
+  CHECK(exists("/src"));
+
+  t = transfer_start("/src", "/dst", 0);
+  CHECK_EQ(run(t), TRANSFER_ERROR);
+  CHECK_EQ(t->error, EEXIST);
+  transfer_free(t);
+  CHECK(exists("/src"));
+  CHECK(exists("/.dst.journal"));
+
+  // the move itself can still finish
+  t = transfer_start("/src", "/dst", 1);
+  CHECK_EQ(run(t), TRANSFER_DONE);
+  transfer_free(t);
+  check_tree("/dst");
+  CHECK(!exists("/src"));
+
+  fs_set_backend(NULL);
+  fs_destroy(fs);
+}
+
+static void test_move_lost_journal_removal(void) {
+  fs_backend_t *fs = make_tree();
+  fs_backend_t other = *fs;
+  transfer_t   *t;
+  char         journal[1024];
+  ssize_t      len;
+
+  other.rename  = cross_rename;
+  other.destroy = NULL;
+  fs_set_backend(&other);
+
+  // power cut after the source was removed but before the journal was
+  t = transfer_start("/src", "/dst", 1);
+  CHECK_EQ(run_until(t, TRANSFER_REMOVE, 0), TRANSFER_REMOVE);
+  len = get_file("/.dst.journal", journal, sizeof(journal));
+  CHECK(len > 0);
+  CHECK_EQ(run(t), TRANSFER_DONE);
+  transfer_free(t);
+  put_file("/.dst.journal", journal, len);
+
+  t = transfer_start("/src", "/dst", 1);
+  CHECK_EQ(run(t), TRANSFER_DONE);
+  transfer_free(t);
+  check_tree("/dst");
+  CHECK(!exists("/.dst.journal"));
+
+  fs_set_backend(NULL);
+  fs_destroy(fs);
+}
+
+int main(void) {
+  RUN(test_copy);
+  RUN(test_copy_resume);
+  RUN(test_copy_errors);
+  RUN(test_move_rename);
+  RUN(test_move_resume_remove);
+  RUN(test_copy_after_move_removal);
+  RUN(test_move_lost_journal_removal);
+  DONE();
+}